@@ -1,6 +1,65 @@
 #include "yalisp.h"
 
-int main() {
-  run_yalisp_shell();
+int main(int argc, char **argv) {
+  // yalisp --profile profile.txt ...: loads the functions' profiles from a
+  // previous run at startup and writes them back at exit.
+  const char *profile_path = NULL;
+  if (argc >= 3 && strcmp(argv[1], "--profile") == 0) {
+    profile_path = argv[2];
+    argv += 2;
+    argc -= 2;
+  }
+
+  // yalisp --prelude prelude.lisp job1.lisp job2.lisp ...
+  if (argc >= 3 && strcmp(argv[1], "--prelude") == 0) {
+    context *prelude = create_context();
+    if (profile_path) {
+      result res = load_function_profiles(prelude, profile_path);
+      if (res.is_error)
+        printf("Error: %s: %s\n", profile_path, res.error_message);
+      free_result(res);
+    }
+
+    result res = load_yalisp_file(prelude, argv[2]);
+    if (res.is_error) {
+      printf("Error: %s: %s\n", argv[2], res.error_message);
+      free_result(res);
+      return 1;
+    }
+    free_result(res);
+    freeze_context(prelude);
+
+    int failures =
+        run_yalisp_workers(prelude, argv + 3, argc - 3, profile_path);
+    free_context(prelude);
+    return failures == 0 ? 0 : 1;
+  }
+
+  // yalisp --heap-dump heap.txt: dumps the heap when the shell exits.
+  const char *heap_dump_path = NULL;
+  if (argc >= 3 && strcmp(argv[1], "--heap-dump") == 0)
+    heap_dump_path = argv[2];
+
+  context *ctx = create_context();
+  if (profile_path) {
+    result res = load_function_profiles(ctx, profile_path);
+    if (res.is_error)
+      printf("Error: %s: %s\n", profile_path, res.error_message);
+    free_result(res);
+  }
+  run_yalisp_shell(ctx);
+  if (heap_dump_path) {
+    result res = write_heap_dump(ctx, heap_dump_path);
+    if (res.is_error)
+      printf("Error: %s\n", res.error_message);
+    free_result(res);
+  }
+  if (profile_path) {
+    result res = write_function_profiles(ctx, profile_path, 0);
+    if (res.is_error)
+      printf("Error: %s\n", res.error_message);
+    free_result(res);
+  }
+  free_context(ctx);
   return 0;
 }
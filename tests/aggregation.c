@@ -0,0 +1,114 @@
+// group-by and hash-join agree with naive nested loops, on one thread and on
+// several.
+
+#include "test.h"
+
+// Keys repeat every `distinct` rows; values are the row numbers.
+void fill_columns(int *keys, int *values, size_t row_count, int distinct) {
+  for (size_t i = 0; i < row_count; i++) {
+    keys[i] = (int)(i * 7919 % (size_t)distinct) - distinct / 2;
+    values[i] = (int)i;
+  }
+}
+
+void test_group_by(size_t row_count, size_t thread_count) {
+  int distinct = 1000;
+  int *keys = malloc(sizeof(int) * row_count);
+  int *values = malloc(sizeof(int) * row_count);
+  fill_columns(keys, values, row_count, distinct);
+
+  const int *columns[] = {values};
+  aggregate aggregates[] = {{aggregate_kind_count, 0},
+                            {aggregate_kind_sum, 0},
+                            {aggregate_kind_min, 0},
+                            {aggregate_kind_max, 0},
+                            {aggregate_kind_avg, 0}};
+  group_table *table =
+      group_by(keys, columns, row_count, aggregates, 5, thread_count);
+  CHECK(table->group_count == (size_t)distinct);
+
+  for (size_t g = 0; g < table->group_count; g++) {
+    int64_t count = 0, sum = 0, min = INT_MAX, max = INT_MIN;
+    for (size_t i = 0; i < row_count; i++) {
+      if (keys[i] != table->keys[g])
+        continue;
+      count++;
+      sum += values[i];
+      min = values[i] < min ? values[i] : min;
+      max = values[i] > max ? values[i] : max;
+    }
+    const aggregate_value *row = table->values + g * 5;
+    CHECK(row[0].integer == count);
+    CHECK(row[1].integer == sum);
+    CHECK(row[2].integer == min);
+    CHECK(row[3].integer == max);
+    CHECK(row[4].average == (double)sum / (double)count);
+  }
+  free_group_table(table);
+  free(keys);
+  free(values);
+}
+
+void test_hash_join(size_t probe_count, size_t thread_count) {
+  size_t build_count = 500;
+  int *build = malloc(sizeof(int) * build_count);
+  int *probe = malloc(sizeof(int) * probe_count);
+  int *unused = malloc(sizeof(int) * probe_count);
+  // Every build key appears twice, and a quarter of the probe keys match.
+  for (size_t i = 0; i < build_count; i++)
+    build[i] = (int)(i / 2);
+  fill_columns(probe, unused, probe_count, 1000);
+
+  join_result *matches =
+      hash_join(build, build_count, probe, probe_count, thread_count);
+  size_t expected = 0;
+  for (size_t i = 0; i < build_count; i++) {
+    for (size_t j = 0; j < probe_count; j++)
+      expected += build[i] == probe[j];
+  }
+  CHECK(matches->match_count == expected);
+  for (size_t i = 0; i < matches->match_count; i++) {
+    CHECK(matches->build_rows[i] < build_count &&
+          matches->probe_rows[i] < probe_count &&
+          build[matches->build_rows[i]] == probe[matches->probe_rows[i]]);
+  }
+  free_join_result(matches);
+  free(build);
+  free(probe);
+  free(unused);
+}
+
+void test_builtins() {
+  context *ctx = create_context();
+  // Groups come in no particular order, so these have a single one.
+  CHECK_EVAL(ctx, "(group-by (vector 1 1 1) :count :sum (vector 1 2 4))",
+             "#(#(1 3 7))");
+  CHECK_EVAL(ctx,
+             "(group-by (vector 2 2 2) :min (vector 5 6 7) "
+             ":max (vector 5 6 7) :avg (vector 1 2 4) :threads 2)",
+             "#(#(2 5 7 2))");
+  CHECK_EVAL(ctx, "(vector-length (group-by (vector 2 1 2) :count))", "2");
+  CHECK_EVAL(ctx, "(group-by (vector 1 2) :sum (vector 1))",
+             "Error: Expected vectors of integers of the same length");
+  CHECK_EVAL(ctx, "(group-by (vector 1 1) :sum (vector 2000000000 "
+                  "2000000000))",
+             "Error: Aggregate doesn't fit an integer");
+  CHECK_EVAL(ctx, "(group-by (vector 1) :median (vector 1))",
+             "Error: group-by expects aggregates like :count or :sum column");
+
+  CHECK_EVAL(ctx, "(hash-join (vector 7) (vector 1 7 2 7))",
+             "#(#(0 1) #(0 3))");
+  CHECK_EVAL(ctx, "(hash-join (vector 1) (vector 2))", "#()");
+  CHECK_EVAL(ctx, "(hash-join (vector 1) (vector 1) :threads 0)",
+             "Error: :threads expects a positive integer");
+  free_context(ctx);
+}
+
+int main() {
+  test_group_by(1000, 1);
+  test_group_by(100 * 1000, 4);
+  test_hash_join(1000, 1);
+  test_hash_join(100 * 1000, 4);
+  test_builtins();
+  return finish_tests();
+}
@@ -0,0 +1,52 @@
+// eval_batch gives the same results on one thread and on several.
+
+#include "test.h"
+
+void check_batch(context *ctx, const char *source, size_t thread_count) {
+  size_t pos = 0;
+  parse_result parsed = parse(source, &pos);
+  char *parameters[] = {"a", "b"};
+  size_t row_count = 1000;
+  value *rows = malloc(sizeof(value) * row_count * 2);
+  for (size_t i = 0; i < row_count; i++) {
+    rows[2 * i] = create_int_value((int)i);
+    rows[2 * i + 1] = create_int_value(1);
+  }
+
+  result *results = eval_batch(ctx, parsed.node, parameters, 2, rows,
+                               row_count, thread_count);
+  for (size_t i = 0; i < row_count; i++) {
+    CHECK(!results[i].is_error &&
+          results[i].result_value.int_value == (int)i + 2);
+    free_result(results[i]);
+  }
+  free(results);
+  free(rows);
+  free_parse_result(parsed);
+}
+
+void test_threads() {
+  context *ctx = create_context();
+  CHECK_EVAL(ctx, "(define (add a b) (+ a b))", "<function add>");
+  check_batch(ctx, "(add a (+ b 1))", 1);
+  check_batch(ctx, "(add a (+ b 1))", 4);
+  free_context(ctx);
+}
+
+// Rows evaluated while a file is being loaded see the file's definitions.
+void test_staged_definitions() {
+  context *ctx = create_context();
+  global_table staged = {NULL, 0, 0};
+  ctx->staged_globals = &staged;
+  CHECK_EVAL(ctx, "(define (add a b) (+ a b))", "<function add>");
+  check_batch(ctx, "(add a (+ b 1))", 4);
+  ctx->staged_globals = NULL;
+  commit_staged_globals(ctx, &staged);
+  free_context(ctx);
+}
+
+int main() {
+  test_threads();
+  test_staged_definitions();
+  return finish_tests();
+}
@@ -0,0 +1,59 @@
+// Integer literals are parsed eight digits at a time where possible, and
+// printed by table.
+
+#include "test.h"
+
+void check_literal(const char *literal, const char *expected) {
+  context *ctx = create_context();
+  CHECK_EVAL(ctx, literal, expected);
+  free_context(ctx);
+}
+
+void test_decimal() {
+  check_literal("0", "0");
+  check_literal("7", "7");
+  check_literal("1234567", "1234567");
+  check_literal("12345678", "12345678");
+  check_literal("123456789", "123456789");
+  check_literal("99999999", "99999999");
+  check_literal("100000000", "100000000");
+  check_literal("2147483647", "2147483647");
+  check_literal("2147483648", "Error: Integer literal out of range");
+  check_literal("9999999999", "Error: Integer literal out of range");
+  check_literal("12345678901", "Error: Integer literal out of range");
+
+  // Leading zeros don't count towards the ten digits an int can hold.
+  check_literal("00000000000000000042", "42");
+  check_literal("0002147483647", "2147483647");
+  check_literal("00000000", "0");
+}
+
+void test_prefixed() {
+  check_literal("0x1F", "31");
+  check_literal("0xffffffff", "-1");
+  check_literal("0x7FFFFFFF", "2147483647");
+  check_literal("0x100000000", "Error: Integer literal out of range");
+  check_literal("0b1010", "10");
+  check_literal("0b", "Error: Integer literal has no digits");
+  check_literal("0x", "Error: Integer literal has no digits");
+}
+
+void test_printing() {
+  int values[] = {0, 9, 10, 99, 100, -1, -10, INT_MAX, INT_MIN, 1000000000};
+  for (size_t i = 0; i < sizeof(values) / sizeof(int); i++) {
+    char buffer[11];
+    char *digits = format_int(values[i], buffer);
+    char expected[16];
+    snprintf(expected, sizeof(expected), "%d", values[i]);
+    size_t length = buffer + sizeof(buffer) - digits;
+    CHECK(length == strlen(expected) &&
+          memcmp(digits, expected, length) == 0);
+  }
+}
+
+int main() {
+  test_decimal();
+  test_prefixed();
+  test_printing();
+  return finish_tests();
+}
@@ -0,0 +1,137 @@
+// Interrupt requests from other threads are served at the next call.
+
+#include "test.h"
+
+typedef struct delayed_interrupt {
+  context *ctx;
+  interrupt_request request;
+  useconds_t delay_us;
+} delayed_interrupt;
+
+void *interrupt_later(void *data) {
+  delayed_interrupt *later = data;
+  usleep(later->delay_us);
+  request_interrupt(later->ctx, later->request);
+  return NULL;
+}
+
+// A file with enough lines that calling a function on each takes a while.
+char *write_long_file(size_t line_count) {
+  char *text = malloc(line_count * 2 + 1);
+  for (size_t i = 0; i < line_count; i++) {
+    text[2 * i] = 'x';
+    text[2 * i + 1] = '\n';
+  }
+  text[line_count * 2] = '\0';
+  char *path = write_temp_file(text);
+  free(text);
+  return path;
+}
+
+void test_cancel() {
+  context *ctx = create_context();
+  CHECK_EVAL(ctx, "(define (one line) 1)", "<function one>");
+
+  // A pending request stops the next evaluation and is gone after.
+  request_interrupt(ctx, interrupt_cancel);
+  CHECK_EVAL(ctx, "(one \"x\")", "Error: Evaluation was interrupted");
+  CHECK_EVAL(ctx, "(one \"x\")", "1");
+
+  char *path = write_long_file(4 * 1000 * 1000);
+  char *source = NULL;
+  size_t length = 0;
+  FILE *out = open_memstream(&source, &length);
+  fprintf(out, "(for-each-line \"%s\" one)", path);
+  fclose(out);
+
+  delayed_interrupt later = {ctx, interrupt_cancel, 10 * 1000};
+  pthread_t thread;
+  pthread_create(&thread, NULL, interrupt_later, &later);
+  CHECK_EVAL(ctx, source, "Error: Evaluation was interrupted");
+  pthread_join(thread, NULL);
+  CHECK_EVAL(ctx, "(one \"x\")", "1");
+
+  unlink(path);
+  free(path);
+  free(source);
+  free_context(ctx);
+}
+
+// The threads of map-lines and eval_batch stop at a cancel sent to the
+// context that started them.
+void test_cancel_threads() {
+  context *ctx = create_context();
+  CHECK_EVAL(ctx, "(define (one line) 1)", "<function one>");
+
+  char *path = write_long_file(4 * 1000 * 1000);
+  char *source = NULL;
+  size_t length = 0;
+  FILE *out = open_memstream(&source, &length);
+  fprintf(out, "(map-lines \"%s\" one :threads 4)", path);
+  fclose(out);
+
+  delayed_interrupt later = {ctx, interrupt_cancel, 10 * 1000};
+  pthread_t thread;
+  pthread_create(&thread, NULL, interrupt_later, &later);
+  CHECK_EVAL(ctx, source, "Error: Evaluation was interrupted");
+  pthread_join(thread, NULL);
+  CHECK_EVAL(ctx, "(one \"x\")", "1");
+
+  // eval_batch doesn't reach a safe point itself, so only the children can
+  // have served this one.
+  size_t pos = 0;
+  parse_result parsed = parse("(one line)", &pos);
+  char *parameters[] = {"line"};
+  value rows[4];
+  for (size_t i = 0; i < 4; i++)
+    rows[i] = create_int_value((int)i);
+  request_interrupt(ctx, interrupt_cancel);
+  result *results = eval_batch(ctx, parsed.node, parameters, 1, rows, 4, 4);
+  for (size_t i = 0; i < 4; i++) {
+    CHECK(results[i].is_error &&
+          strcmp(results[i].error_message, "Evaluation was interrupted") == 0);
+    free_result(results[i]);
+  }
+  free(results);
+  free_parse_result(parsed);
+  CHECK_EVAL(ctx, "(one \"x\")", "1");
+
+  unlink(path);
+  free(path);
+  free(source);
+  free_context(ctx);
+}
+
+typedef struct sampled_stack {
+  size_t depth;
+  const char *top;
+} sampled_stack;
+
+void record_stack(const call_frame *top, void *data) {
+  sampled_stack *sample = data;
+  sample->top = top ? top->fn->name : NULL;
+  for (; top; top = top->caller)
+    sample->depth++;
+}
+
+void test_sample() {
+  context *ctx = create_context();
+  sampled_stack sample = {0, NULL};
+  ctx->sampler = record_stack;
+  ctx->sampler_data = &sample;
+  CHECK_EVAL(ctx, "(define (inner x) x)", "<function inner>");
+  CHECK_EVAL(ctx, "(define (outer x) (inner x))", "<function outer>");
+
+  request_interrupt(ctx, interrupt_sample);
+  CHECK_EVAL(ctx, "(outer 7)", "7");
+  CHECK(sample.depth == 1);
+  CHECK(sample.top && strcmp(sample.top, "outer") == 0);
+  free_context(ctx);
+}
+
+int main() {
+  test_cancel();
+  test_cancel_threads();
+  test_sample();
+  return finish_tests();
+}
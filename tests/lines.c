@@ -0,0 +1,130 @@
+// for-each-line and map-lines give the same results on one thread and on
+// several.
+
+#include "test.h"
+
+// Lines "0" to "<count - 1>", big enough to be split between threads.
+char *write_numbered_lines(size_t count) {
+  char *text = NULL;
+  size_t length = 0;
+  FILE *out = open_memstream(&text, &length);
+  for (size_t i = 0; i < count; i++) {
+    fprintf(out, "%zu\n", i);
+  }
+  fclose(out);
+  char *path = write_temp_file(text);
+  free(text);
+  return path;
+}
+
+char *format_source(const char *format, const char *path) {
+  char *source = NULL;
+  size_t length = 0;
+  FILE *out = open_memstream(&source, &length);
+  fprintf(out, format, path);
+  fclose(out);
+  return source;
+}
+
+void check_lines(context *ctx, const char *format, const char *path,
+                 const char *expected) {
+  char *source = format_source(format, path);
+  CHECK_EVAL(ctx, source, expected);
+  free(source);
+}
+
+void test_threads() {
+  context *ctx = create_context();
+  CHECK_EVAL(ctx, "(define (one line) 1)", "<function one>");
+  CHECK_EVAL(ctx, "(define (marker line) \"x\")", "<function marker>");
+
+  size_t count = 200 * 1000;
+  char *path = write_numbered_lines(count);
+  check_lines(ctx, "(for-each-line \"%s\" one)", path, "200000");
+  check_lines(ctx, "(map-lines \"%s\" one :threads 1)", path, "200000");
+  check_lines(ctx, "(map-lines \"%s\" one :threads 4)", path, "200000");
+
+  char *marked = format_source("(map-lines \"%s\" marker :threads 4)", path);
+  result res = eval_source(ctx, marked);
+  CHECK(!res.is_error && res.result_value.type == value_type_string &&
+        strlen(res.result_value.string_value) == count);
+  free_result(res);
+  free(marked);
+
+  unlink(path);
+  free(path);
+  free_context(ctx);
+}
+
+void test_string_results_keep_line_order() {
+  context *ctx = create_context();
+  CHECK_EVAL(ctx, "(define (same line) (concat line \",\"))",
+             "<function same>");
+  char *path = write_numbered_lines(100 * 1000);
+  char *source = format_source("(map-lines \"%s\" same :threads 3)", path);
+  result res = eval_source(ctx, source);
+  CHECK(!res.is_error);
+  if (!res.is_error) {
+    const char *text = res.result_value.string_value;
+    CHECK(strncmp(text, "0,1,2,", 6) == 0);
+    CHECK(strcmp(text + strlen(text) - 6, "99999,") == 0);
+  }
+  free_result(res);
+  free(source);
+  unlink(path);
+  free(path);
+  free_context(ctx);
+}
+
+// The threads see the definitions of a file that is still being loaded.
+void test_map_lines_in_loaded_file() {
+  context *ctx = create_context();
+  char *lines = write_numbered_lines(200 * 1000);
+  char *source = format_source("(define (one line) 1)\n"
+                               "(define (count line) (one line))\n"
+                               "(define total (map-lines \"%s\" count "
+                               ":threads 4))\n",
+                               lines);
+  char *path = write_temp_file(source);
+  result res = load_yalisp_file(ctx, path);
+  CHECK(!res.is_error);
+  free_result(res);
+  CHECK_EVAL(ctx, "total", "200000");
+  CHECK_EVAL(ctx, "(one \"x\")", "1");
+
+  unlink(path);
+  unlink(lines);
+  free(path);
+  free(lines);
+  free(source);
+  free_context(ctx);
+}
+
+// Sums are kept in 64 bits until the end, where the total has to fit.
+void test_large_sums() {
+  context *ctx = create_context();
+  CHECK_EVAL(ctx, "(define (ten-thousand line) 10000)",
+             "<function ten-thousand>");
+  CHECK_EVAL(ctx, "(define (twenty-thousand line) 20000)",
+             "<function twenty-thousand>");
+  char *path = write_numbered_lines(200 * 1000);
+  check_lines(ctx, "(map-lines \"%s\" ten-thousand :threads 1)", path,
+              "2000000000");
+  check_lines(ctx, "(map-lines \"%s\" ten-thousand :threads 4)", path,
+              "2000000000");
+  check_lines(ctx, "(map-lines \"%s\" twenty-thousand :threads 1)", path,
+              "Error: Sum of the lines doesn't fit an integer");
+  check_lines(ctx, "(map-lines \"%s\" twenty-thousand :threads 4)", path,
+              "Error: Sum of the lines doesn't fit an integer");
+  unlink(path);
+  free(path);
+  free_context(ctx);
+}
+
+int main() {
+  test_threads();
+  test_string_results_keep_line_order();
+  test_map_lines_in_loaded_file();
+  test_large_sums();
+  return finish_tests();
+}
@@ -0,0 +1,53 @@
+// Matchers report every occurrence of their patterns, overlapping ones too,
+// however the patterns were given.
+
+#include "test.h"
+
+void test_scan() {
+  context *ctx = create_context();
+  CHECK_EVAL(ctx, "(define m (make-matcher \"he\" \"she\" \"hers\"))",
+             "<matcher 3>");
+  CHECK_EVAL(ctx, "(matcher-scan m \"ushers\")", "#(#(1 4) #(0 4) #(2 6))");
+  CHECK_EVAL(ctx, "(matcher-scan m \"nothing\")", "#()");
+  CHECK_EVAL(ctx, "(matcher-find m \"ushers\")", "1");
+  CHECK_EVAL(ctx, "(matcher-find m \"nothing\")", "-1");
+
+  CHECK_EVAL(ctx, "(define v (make-matcher (vector \"ab\" \"b\")))",
+             "<matcher 2>");
+  CHECK_EVAL(ctx, "(matcher-scan v \"abab\")",
+             "#(#(0 2) #(1 2) #(0 4) #(1 4))");
+  CHECK_EVAL(ctx, "(vector-length (matcher-scan (make-matcher (vector)) "
+                  "\"abc\"))",
+             "0");
+
+  CHECK_EVAL(ctx, "(make-matcher (vector \"a\" 1))",
+             "Error: Expected a string argument");
+  CHECK_EVAL(ctx, "(make-matcher (vector \"a\" \"\"))",
+             "Error: Patterns must not be empty");
+  CHECK_EVAL(ctx, "(matcher-scan m 1)", "Error: Expected a string argument");
+  free_context(ctx);
+}
+
+void test_load() {
+  context *ctx = create_context();
+  char *path = write_temp_file("error\n\ntimeout\n");
+  char *source = NULL;
+  size_t length = 0;
+  FILE *out = open_memstream(&source, &length);
+  fprintf(out, "(define m (load-matcher \"%s\"))", path);
+  fclose(out);
+  CHECK_EVAL(ctx, source, "<matcher 2>");
+  CHECK_EVAL(ctx, "(matcher-scan m \"timeout after error\")",
+             "#(#(1 7) #(0 19))");
+
+  unlink(path);
+  free(path);
+  free(source);
+  free_context(ctx);
+}
+
+int main() {
+  test_scan();
+  test_load();
+  return finish_tests();
+}
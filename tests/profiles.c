@@ -0,0 +1,53 @@
+// Prelude functions are profiled and tiered up through the copies of the
+// contexts calling them, and their profiles are written with the context's.
+
+#include "test.h"
+
+void test_prelude_functions() {
+  context *prelude = create_context();
+  CHECK_EVAL(prelude, "(define (add a b) (+ a b))", "<function add>");
+  CHECK_EVAL(prelude, "(define (sub a b) (- a b))", "<function sub>");
+  freeze_context(prelude);
+
+  context *ctx = create_overlay_context(prelude);
+  CHECK_EVAL(ctx, "(define (twice x) (add x x))", "<function twice>");
+  for (int i = 0; i < TIER_OPTIMIZED_CALLS + 10; i++)
+    CHECK_EVAL(ctx, "(twice 3)", "6");
+
+  result add = eval_source(ctx, "add");
+  function *original = add.result_value.function_value;
+  function *copy = find_function_copy(ctx, original);
+  CHECK(atomic_load(&original->call_count) == 0);
+  CHECK(atomic_load(&atomic_load(&original->code)->plan) == NULL);
+  CHECK(copy && atomic_load(&copy->call_count) >= TIER_OPTIMIZED_CALLS);
+  CHECK(copy && atomic_load(&copy->code) &&
+        atomic_load(&atomic_load(&copy->code)->plan));
+  free_result(add);
+
+  // Children count towards the copies their parent made.
+  CHECK_EVAL(ctx, "(sub 3 1)", "2");
+  result sub = eval_source(ctx, "sub");
+  function *sub_copy = find_function_copy(ctx, sub.result_value.function_value);
+  free_result(sub);
+  context *child = create_child_context(ctx);
+  CHECK_EVAL(child, "(sub 1 2)", "-1");
+  CHECK(child->function_copy_count == 0);
+  CHECK(sub_copy && atomic_load(&sub_copy->call_count) == 2);
+  free_context(child);
+
+  char *path = write_temp_file("");
+  write_function_profiles(ctx, path, 1);
+  char *profiles = read_file(path);
+  CHECK(profiles && strstr(profiles, "add ") && strstr(profiles, "twice "));
+  free(profiles);
+
+  unlink(path);
+  free(path);
+  free_context(ctx);
+  free_context(prelude);
+}
+
+int main() {
+  test_prelude_functions();
+  return finish_tests();
+}
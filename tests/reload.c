@@ -0,0 +1,93 @@
+// Reloading a file evaluates only the forms that changed, and a failed load
+// keeps the definitions of the previous one.
+
+#include "test.h"
+
+void check_load(context *ctx, const char *path, const char *expected) {
+  result res = load_yalisp_file(ctx, path);
+  char *actual = result_text(res);
+  free_result(res);
+  if (strcmp(actual, expected) != 0) {
+    fprintf(stderr, "loading %s gave %s, expected %s\n", path, actual,
+            expected);
+    test_failures++;
+  }
+  free(actual);
+}
+
+void test_reload_diffing() {
+  context *ctx = create_context();
+  char *path = write_temp_file("(define a 1)\n(define (f x) (+ x a))\n");
+  check_load(ctx, path, "2");
+  CHECK_EVAL(ctx, "(f 1)", "2");
+
+  // Unchanged, and changed only in layout, which parses to the same AST.
+  check_load(ctx, path, "0");
+  rewrite_file(path, "(define a 1)\n(define (f x)\n  (+ x   a))\n");
+  check_load(ctx, path, "0");
+
+  rewrite_file(path, "(define a 10)\n(define (f x)\n  (+ x   a))\n");
+  check_load(ctx, path, "1");
+  CHECK_EVAL(ctx, "(f 1)", "11");
+
+  unlink(path);
+  free(path);
+  free_context(ctx);
+}
+
+void test_failed_load_keeps_definitions() {
+  context *ctx = create_context();
+  char *path = write_temp_file("(define a 1)\n(define b 2)\n");
+  check_load(ctx, path, "2");
+
+  rewrite_file(path, "(define a 5)\n(define b (missing))\n");
+  check_load(ctx, path, "Error: Unknown operator");
+  CHECK_EVAL(ctx, "(+ a b)", "3");
+
+  // The failed load's forms didn't count as evaluated.
+  rewrite_file(path, "(define a 5)\n(define b 2)\n");
+  check_load(ctx, path, "1");
+  CHECK_EVAL(ctx, "(+ a b)", "7");
+
+  unlink(path);
+  free(path);
+  free_context(ctx);
+}
+
+void test_nested_loads_commit_together() {
+  context *ctx = create_context();
+  char *inner = write_temp_file("(define helper 5)\n");
+  char *outer_source = NULL;
+  size_t length = 0;
+  FILE *out = open_memstream(&outer_source, &length);
+  fprintf(out, "(load \"%s\")\n(define x (missing))\n", inner);
+  fclose(out);
+  char *outer = write_temp_file(outer_source);
+
+  check_load(ctx, outer, "Error: Unknown operator");
+  CHECK_EVAL(ctx, "helper", "Error: Undefined symbol");
+
+  // The inner file's forms were dropped with the failed outer load, so they
+  // are evaluated again.
+  free(outer_source);
+  out = open_memstream(&outer_source, &length);
+  fprintf(out, "(load \"%s\")\n(define x (+ helper 1))\n", inner);
+  fclose(out);
+  rewrite_file(outer, outer_source);
+  check_load(ctx, outer, "2");
+  CHECK_EVAL(ctx, "x", "6");
+
+  unlink(inner);
+  unlink(outer);
+  free(inner);
+  free(outer);
+  free(outer_source);
+  free_context(ctx);
+}
+
+int main() {
+  test_reload_diffing();
+  test_failed_load_keeps_definitions();
+  test_nested_loads_commit_together();
+  return finish_tests();
+}
@@ -0,0 +1,116 @@
+// Pure forms are answered from the cache when evaluated with the same
+// inputs again; impure ones and redefinitions aren't.
+
+#include "test.h"
+
+typedef struct cached_form {
+  parse_result parsed;
+  prepared_form prepared;
+} cached_form;
+
+cached_form parse_cached_form(const char *source) {
+  cached_form form;
+  size_t pos = 0;
+  form.parsed = parse(source, &pos);
+  form.prepared = prepare_form(form.parsed.node);
+  return form;
+}
+
+// Evaluates the form with integer arguments and returns the integer result,
+// or INT_MIN on error.
+int eval_cached_ints(context *ctx, result_cache *cache, cached_form *form,
+                     char **parameters, const int *ints, size_t count) {
+  value arguments[4];
+  for (size_t i = 0; i < count; i++) {
+    arguments[i] = create_int_value(ints[i]);
+  }
+  result res = eval_cached(ctx, cache, &form->prepared, parameters, arguments,
+                           count);
+  int val = res.is_error ? INT_MIN : res.result_value.int_value;
+  free_result(res);
+  return val;
+}
+
+void test_hits_and_misses() {
+  context *ctx = create_context();
+  result_cache *cache = create_result_cache(1024);
+  CHECK_EVAL(ctx, "(define (add a b) (+ a b))", "<function add>");
+  cached_form form = parse_cached_form("(add a b)");
+  char *parameters[] = {"a", "b"};
+
+  int one_two[] = {1, 2};
+  int two_two[] = {2, 2};
+  CHECK(eval_cached_ints(ctx, cache, &form, parameters, one_two, 2) == 3);
+  CHECK(eval_cached_ints(ctx, cache, &form, parameters, one_two, 2) == 3);
+  CHECK(eval_cached_ints(ctx, cache, &form, parameters, two_two, 2) == 4);
+  CHECK(atomic_load(&cache->hits) == 1);
+  CHECK(atomic_load(&cache->misses) == 2);
+
+  // Redefining a function the form calls makes older entries unreachable.
+  CHECK_EVAL(ctx, "(define (add a b) (- a b))", "<function add>");
+  CHECK(eval_cached_ints(ctx, cache, &form, parameters, one_two, 2) == -1);
+  CHECK(atomic_load(&cache->misses) == 3);
+
+  free_parse_result(form.parsed);
+  free_result_cache(cache);
+  free_context(ctx);
+}
+
+// The same inputs bound to other parameters are a different evaluation.
+void test_parameter_names() {
+  context *ctx = create_context();
+  result_cache *cache = create_result_cache(1024);
+  cached_form form = parse_cached_form("(- a b)");
+  char *a_b[] = {"a", "b"};
+  char *b_a[] = {"b", "a"};
+  int one_two[] = {1, 2};
+  CHECK(eval_cached_ints(ctx, cache, &form, a_b, one_two, 2) == -1);
+  CHECK(eval_cached_ints(ctx, cache, &form, b_a, one_two, 2) == 1);
+  CHECK(eval_cached_ints(ctx, cache, &form, a_b, one_two, 2) == -1);
+  CHECK(atomic_load(&cache->hits) == 1);
+
+  free_parse_result(form.parsed);
+  free_result_cache(cache);
+  free_context(ctx);
+}
+
+void test_impure_forms() {
+  context *ctx = create_context();
+  result_cache *cache = create_result_cache(1024);
+  cached_form form = parse_cached_form("(vector a)");
+  char *parameters[] = {"a"};
+  value argument = create_int_value(1);
+  for (int i = 0; i < 2; i++) {
+    result res =
+        eval_cached(ctx, cache, &form.prepared, parameters, &argument, 1);
+    CHECK(!res.is_error && res.result_value.type == value_type_vector);
+    free_result(res);
+  }
+  CHECK(atomic_load(&cache->hits) == 0);
+
+  // Calls through a parameter may call anything.
+  cached_form call = parse_cached_form("(f 1)");
+  char *function_parameters[] = {"f"};
+  CHECK_EVAL(ctx, "(define (g x) (vector x))", "<function g>");
+  result g = eval_source(ctx, "g");
+  for (int i = 0; i < 2; i++) {
+    result res = eval_cached(ctx, cache, &call.prepared, function_parameters,
+                             &g.result_value, 1);
+    CHECK(!res.is_error);
+    free_result(res);
+  }
+  CHECK(atomic_load(&cache->hits) == 0);
+
+  free_result(g);
+  free_parse_result(call.parsed);
+  free_parse_result(form.parsed);
+  free_result_cache(cache);
+  free_context(ctx);
+}
+
+int main() {
+  test_hits_and_misses();
+  test_parameter_names();
+  test_impure_forms();
+  return finish_tests();
+}
@@ -0,0 +1,82 @@
+// Sandboxed evaluations stop at their limits and can't use builtins with
+// effects outside the evaluation.
+
+#include "test.h"
+
+void check_sandboxed(context *ctx, const char *source,
+                     const sandbox_limits *limits, const char *expected) {
+  result res = eval_sandboxed_source(ctx, source, limits);
+  char *actual = result_text(res);
+  free_result(res);
+  if (strcmp(actual, expected) != 0) {
+    fprintf(stderr, "sandboxed %s gave %s, expected %s\n", source, actual,
+            expected);
+    test_failures++;
+  }
+  free(actual);
+}
+
+void test_limits() {
+  context *ctx = create_context();
+  CHECK_EVAL(ctx, "(define (forever n) (forever (+ n 1)))",
+             "<function forever>");
+  CHECK_EVAL(ctx, "(define (add a b) (+ a b))", "<function add>");
+
+  sandbox_limits fuel = {1000, 0, 0, NULL};
+  check_sandboxed(ctx, "(add 1 2)", &fuel, "3");
+  check_sandboxed(ctx, "(forever 0)", &fuel,
+                  "Error: Evaluation ran out of fuel");
+
+  // Sketch sizes are checked before anything is allocated.
+  sandbox_limits memory = {0, 64 * 1024, 0, NULL};
+  check_sandboxed(ctx, "(make-bloom-filter 1000000000 3)", &memory,
+                  "Error: Evaluation exceeded its memory limit");
+  result res =
+      eval_sandboxed_source(ctx, "(make-bloom-filter 1024 3)", &memory);
+  CHECK(!res.is_error && res.result_value.type == value_type_sketch);
+  free_result(res);
+
+  // Deep enough that the clock is checked after the deadline passed.
+  sandbox_limits timeout = {100000, 0, 1, NULL};
+  check_sandboxed(ctx, "(forever 0)", &timeout, "Error: Evaluation timed out");
+
+  // The limits only apply to the sandboxed evaluation.
+  CHECK_EVAL(ctx, "(add 2 3)", "5");
+  free_context(ctx);
+}
+
+void test_allowed_builtins() {
+  context *ctx = create_context();
+  sandbox_limits defaults = {1000, 0, 0, NULL};
+  check_sandboxed(ctx, "(concat \"a\" \"b\")", &defaults, "\"ab\"");
+  check_sandboxed(ctx, "(define x 1)", &defaults,
+                  "Error: Operator is not allowed in the sandbox");
+  check_sandboxed(ctx, "(file-bytes \"/etc/passwd\")", &defaults,
+                  "Error: Operator is not allowed in the sandbox");
+  check_sandboxed(ctx, "(heap-stats)", &defaults,
+                  "Error: Operator is not allowed in the sandbox");
+
+  // Builtins that modify their arguments could reach the host's values.
+  CHECK_EVAL(ctx, "(define v (vector 3 2 1))", "#(3 2 1)");
+  check_sandboxed(ctx, "(sort! v)", &defaults,
+                  "Error: Operator is not allowed in the sandbox");
+  check_sandboxed(ctx, "(sort v)", &defaults, "#(1 2 3)");
+  CHECK_EVAL(ctx, "v", "#(3 2 1)");
+  CHECK_EVAL(ctx, "(define s (make-bloom-filter 64 2))", "<bloom-filter>");
+  check_sandboxed(ctx, "(sketch-add s \"x\")", &defaults,
+                  "Error: Operator is not allowed in the sandbox");
+  CHECK_EVAL(ctx, "(sketch-contains s \"x\")", "0");
+
+  const char *only_plus[] = {"+", NULL};
+  sandbox_limits listed = {1000, 0, 0, only_plus};
+  check_sandboxed(ctx, "(+ 1 2)", &listed, "3");
+  check_sandboxed(ctx, "(- 1 2)", &listed,
+                  "Error: Operator is not allowed in the sandbox");
+  free_context(ctx);
+}
+
+int main() {
+  test_limits();
+  test_allowed_builtins();
+  return finish_tests();
+}
@@ -0,0 +1,145 @@
+// Sorting orders every kind of input like qsort does, and top-k returns the
+// largest items, largest first.
+
+#include "test.h"
+
+int compare_ints(const void *a, const void *b) {
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+// Random keys, including the extremes, and long runs of equal keys.
+void fill_keys(int *keys, size_t count, uint64_t seed) {
+  for (size_t i = 0; i < count; i++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    int key = (int)(uint32_t)(seed >> 32);
+    if (i % 7 == 0)
+      key %= 16;
+    keys[i] = i % 101 == 0 ? INT_MIN : i % 103 == 0 ? INT_MAX : key;
+  }
+}
+
+void test_int_sorts(size_t count, size_t thread_count) {
+  int *keys = malloc(sizeof(int) * count);
+  int *expected = malloc(sizeof(int) * count);
+  fill_keys(keys, count, count);
+  memcpy(expected, keys, sizeof(int) * count);
+  qsort(expected, count, sizeof(int), compare_ints);
+
+  int *radix = malloc(sizeof(int) * count);
+  memcpy(radix, keys, sizeof(int) * count);
+  radix_sort_ints(radix, count);
+  CHECK(memcmp(radix, expected, sizeof(int) * count) == 0);
+
+  parallel_sort_ints(keys, count, thread_count);
+  CHECK(memcmp(keys, expected, sizeof(int) * count) == 0);
+
+  size_t k = count < 10 ? count : 10;
+  int top[10];
+  CHECK(top_k_ints(radix, count, k, top) == k);
+  for (size_t i = 0; i < k; i++)
+    CHECK(top[i] == expected[count - 1 - i]);
+
+  free(keys);
+  free(expected);
+  free(radix);
+}
+
+void test_value_sorts() {
+  context *ctx = create_context();
+  CHECK_EVAL(ctx, "(sort (vector 3 1 2 1))", "#(1 1 2 3)");
+  CHECK_EVAL(ctx, "(sort (vector))", "#()");
+  CHECK_EVAL(ctx, "(sort (vector \"b\" 2 \"a\" 1))", "#(1 2 \"a\" \"b\")");
+  CHECK_EVAL(ctx, "(sort (vector 1 (vector 2)))",
+             "Error: Cannot compare values of this type");
+
+  // sort leaves its argument alone, sort! sorts it in place.
+  CHECK_EVAL(ctx, "(define v (vector 3 1 2))", "#(3 1 2)");
+  CHECK_EVAL(ctx, "(sort v)", "#(1 2 3)");
+  CHECK_EVAL(ctx, "v", "#(3 1 2)");
+  CHECK_EVAL(ctx, "(sort! v)", "#(1 2 3)");
+  CHECK_EVAL(ctx, "v", "#(1 2 3)");
+
+  CHECK_EVAL(ctx, "(define (descending a b) (- b a))", "<function descending>");
+  CHECK_EVAL(ctx, "(sort (vector 3 1 2) descending)", "#(3 2 1)");
+  CHECK_EVAL(ctx, "(define (by-last a b) (- (vector-ref a 1) "
+                  "(vector-ref b 1)))",
+             "<function by-last>");
+  CHECK_EVAL(ctx, "(define (pair a b) (vector a b))", "<function pair>");
+  CHECK_EVAL(ctx,
+             "(sort (vector (pair 1 3) (pair 2 1) (pair 3 2)) by-last)",
+             "#(#(2 1) #(3 2) #(1 3))");
+  CHECK_EVAL(ctx, "(define (one a) a)", "<function one>");
+  CHECK_EVAL(ctx, "(sort (vector 2 1) one)",
+             "Error: Comparator must take two arguments");
+  CHECK_EVAL(ctx, "(define (bad a b) (missing))", "<function bad>");
+  CHECK_EVAL(ctx, "(sort (vector 2 1) bad)", "Error: Unknown operator");
+
+  CHECK_EVAL(ctx, "(top-k (vector 5 1 9 3) 2)", "#(9 5)");
+  CHECK_EVAL(ctx, "(top-k (vector \"x\" \"a\" \"m\") 5)",
+             "#(\"x\" \"m\" \"a\")");
+  CHECK_EVAL(ctx, "(top-k (vector 5 1 9 3) 2 descending)", "#(1 3)");
+  free_context(ctx);
+}
+
+// pdqsort isn't stable, so items the comparator finds equal come out in any
+// order, but all of them do.
+void test_ties() {
+  context *ctx = create_context();
+  CHECK_EVAL(ctx, "(define (by-first a b) (- (vector-ref a 0) "
+                  "(vector-ref b 0)))",
+             "<function by-first>");
+  CHECK_EVAL(ctx, "(define (pair a b) (vector a b))", "<function pair>");
+
+  char *source = NULL;
+  size_t length = 0;
+  FILE *out = open_memstream(&source, &length);
+  fprintf(out, "(sort (vector");
+  for (int i = 0; i < 200; i++)
+    fprintf(out, " (pair %d %d)", (i * 37) % 5, i);
+  fprintf(out, ") by-first)");
+  fclose(out);
+
+  result res = eval_source(ctx, source);
+  CHECK(!res.is_error);
+  if (!res.is_error) {
+    const vector *sorted = res.result_value.vector_value;
+    int seen[200] = {0};
+    CHECK(sorted->length == 200);
+    for (size_t i = 0; i < sorted->length; i++) {
+      const vector *pair = sorted->items[i].vector_value;
+      if (i > 0)
+        CHECK(sorted->items[i - 1].vector_value->items[0].int_value <=
+              pair->items[0].int_value);
+      seen[pair->items[1].int_value]++;
+    }
+    for (int i = 0; i < 200; i++)
+      CHECK(seen[i] == 1);
+  }
+  free_result(res);
+  free(source);
+  free_context(ctx);
+}
+
+void test_frozen_vectors() {
+  context *prelude = create_context();
+  CHECK_EVAL(prelude, "(define shared (vector 2 1))", "#(2 1)");
+  freeze_context(prelude);
+
+  context *ctx = create_overlay_context(prelude);
+  CHECK_EVAL(ctx, "(sort! shared)", "Error: Cannot modify a frozen vector");
+  CHECK_EVAL(ctx, "(sort shared)", "#(1 2)");
+  free_context(ctx);
+  free_context(prelude);
+}
+
+int main() {
+  test_int_sorts(1, 1);
+  test_int_sorts(1000, 1);
+  test_int_sorts(300 * 1000, 4);
+  test_value_sorts();
+  test_ties();
+  test_frozen_vectors();
+  return finish_tests();
+}
@@ -0,0 +1,121 @@
+// Helpers shared by the tests. Every file in tests/ is a program of its own,
+// built and run by `make test`, that exits with 1 if a check failed.
+
+#include "../yalisp.h"
+
+int test_failures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__,         \
+              #condition);                                                     \
+      test_failures++;                                                         \
+    }                                                                          \
+  } while (0)
+
+// Compares what evaluating `source` in `ctx` prints, or "Error: <message>".
+#define CHECK_EVAL(ctx, source, expected)                                      \
+  do {                                                                         \
+    char *actual = eval_text(ctx, source);                                     \
+    if (strcmp(actual, expected) != 0) {                                       \
+      fprintf(stderr, "%s:%d: %s gave %s, expected %s\n", __FILE__, __LINE__,  \
+              source, actual, expected);                                       \
+      test_failures++;                                                         \
+    }                                                                          \
+    free(actual);                                                              \
+  } while (0)
+
+// Evaluates every form of `source` and returns the last one's result.
+result eval_source(context *ctx, const char *source) {
+  result res = create_success_result(create_int_value(0));
+  size_t pos = 0;
+  skip_whitespace(source, &pos);
+  while (source[pos] != '\0' && !res.is_error) {
+    parse_result parsed = parse_interned(source, &pos, ctx->interner);
+    free_result(res);
+    if (parsed.is_error) {
+      res = create_error_result(parsed.error_message);
+    } else {
+      res = eval_ast_node(ctx, NULL, parsed.node);
+    }
+    free_parse_result(parsed);
+    skip_whitespace(source, &pos);
+  }
+  return res;
+}
+
+// Formats integers, strings, functions, sketches, matchers and vectors of
+// them the way print_value does.
+void format_value(FILE *out, value val) {
+  if (val.type == value_type_int) {
+    fprintf(out, "%d", val.int_value);
+  } else if (val.type == value_type_string) {
+    fprintf(out, "\"%s\"", val.string_value);
+  } else if (val.type == value_type_vector) {
+    fprintf(out, "#(");
+    for (size_t i = 0; i < val.vector_value->length; i++) {
+      if (i > 0)
+        fprintf(out, " ");
+      format_value(out, val.vector_value->items[i]);
+    }
+    fprintf(out, ")");
+  } else if (val.type == value_type_function) {
+    fprintf(out, "<function %s>", val.function_value->name);
+  } else if (val.type == value_type_sketch) {
+    static const char *names[] = {"hyperloglog", "count-min", "bloom-filter"};
+    fprintf(out, "<%s>", names[val.sketch_value->kind]);
+  } else if (val.type == value_type_matcher) {
+    fprintf(out, "<matcher %zu>", val.matcher_value->pattern_count);
+  } else {
+    fprintf(out, "<value of type %d>", (int)val.type);
+  }
+}
+
+char *result_text(result res) {
+  char *text = NULL;
+  size_t length = 0;
+  FILE *out = open_memstream(&text, &length);
+  if (res.is_error) {
+    fprintf(out, "Error: %s", res.error_message);
+  } else {
+    format_value(out, res.result_value);
+  }
+  fclose(out);
+  return text;
+}
+
+char *eval_text(context *ctx, const char *source) {
+  result res = eval_source(ctx, source);
+  char *text = result_text(res);
+  free_result(res);
+  return text;
+}
+
+// Writes `contents` to a new temporary file and returns its path, which the
+// caller unlinks and frees.
+char *write_temp_file(const char *contents) {
+  char *path = strdup("/tmp/yalisp-test-XXXXXX");
+  int fd = mkstemp(path);
+  size_t length = strlen(contents);
+  if (fd < 0 || write(fd, contents, length) != (ssize_t)length) {
+    perror(path);
+    exit(1);
+  }
+  close(fd);
+  return path;
+}
+
+void rewrite_file(const char *path, const char *contents) {
+  FILE *file = fopen(path, "w");
+  if (!file || fputs(contents, file) < 0 || fclose(file) != 0) {
+    perror(path);
+    exit(1);
+  }
+}
+
+int finish_tests() {
+  if (test_failures > 0)
+    fprintf(stderr, "%d checks failed\n", test_failures);
+  return test_failures > 0;
+}
@@ -23,9 +23,460 @@
 #ifndef _YALISP_H_
 #define _YALISP_H_
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Allocator for the small objects the interpreter creates all the time: AST
+// nodes, strings, functions and argument arrays. Blocks come from 64 KiB
+// pages split into one size class each. Every thread keeps a cache of free
+// blocks per size class, so allocating and freeing is a push or pop on a
+// thread local list; only refilling or draining a cache takes the lock and
+// moves a batch of blocks from or to the free lists of their pages. Sizes
+// above the largest class go straight to malloc.
+
+#define HEAP_PAGE_SIZE (64 * 1024)
+#define HEAP_SIZE_CLASS_COUNT 8
+#define HEAP_MAX_BLOCK_SIZE 256
+#define HEAP_CACHE_BATCH 32
+
+static const size_t heap_block_sizes[HEAP_SIZE_CLASS_COUNT] = {
+    16, 32, 48, 64, 96, 128, 192, 256};
+
+// Size class for every size rounded up to a multiple of 16.
+static const unsigned char heap_size_classes[HEAP_MAX_BLOCK_SIZE / 16 + 1] = {
+    0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7};
+
+typedef struct free_block {
+  struct free_block *next;
+} free_block;
+
+// Header at the start of every page, which is aligned to its own size so a
+// block finds its page by masking its address.
+typedef struct heap_page {
+  struct heap_page *next_page;      // all pages of the size class
+  struct heap_page *next_available; // pages with free blocks
+  int is_available;
+  int is_sealed; // never allocated from again, see seal_heap_pages
+  size_t size_class;
+  size_t live_count; // blocks not on the page's free list
+  free_block *free_list;
+} heap_page;
+
+#define HEAP_PAGE_HEADER_SIZE ((sizeof(heap_page) + 15) & ~(size_t)15)
+
+typedef struct heap_size_class {
+  heap_page *pages;
+  heap_page *available;
+} heap_size_class;
+
+typedef enum {
+  heap_kind_ast_node,
+  heap_kind_string,
+  heap_kind_function,
+  heap_kind_handle,
+  heap_kind_weak_ref,
+  heap_kind_frame,
+  heap_kind_bytevector,
+  heap_kind_sketch,
+  heap_kind_matcher,
+  heap_kind_vector,
+  heap_kind_count
+} heap_kind;
+
+static const char *heap_kind_names[heap_kind_count] = {
+    "ast nodes", "strings",     "functions", "handles",
+    "weak refs", "frames",      "bytevectors", "sketches",
+    "matchers",  "vectors"};
+
+// Allocation counters of one thread. Only the owning thread writes them, so
+// they're bumped with plain relaxed loads and stores rather than atomic
+// read-modify-writes; other threads only read them for statistics.
+typedef struct heap_counters {
+  atomic_size_t allocated[heap_kind_count];
+  atomic_size_t freed[heap_kind_count];
+  atomic_size_t allocated_bytes[heap_kind_count];
+  atomic_size_t freed_bytes[heap_kind_count];
+} heap_counters;
+
+typedef struct heap_cache {
+  free_block *blocks[HEAP_SIZE_CLASS_COUNT];
+  size_t counts[HEAP_SIZE_CLASS_COUNT];
+  int is_registered;
+  size_t seal_epoch; // of the last seal the cache was drained for
+  heap_counters counters;
+  struct heap_cache *next_cache;
+} heap_cache;
+
+static struct {
+  pthread_mutex_t lock;
+  heap_size_class classes[HEAP_SIZE_CLASS_COUNT];
+  size_t page_count;
+  size_t free_bytes;  // on the free lists of pages, not in thread caches
+  heap_cache *caches; // of every live thread that used the heap
+  atomic_size_t seal_epoch; // bumped by seal_heap_pages
+  size_t exited_allocated[heap_kind_count]; // counters of exited threads
+  size_t exited_freed[heap_kind_count];
+  size_t exited_allocated_bytes[heap_kind_count];
+  size_t exited_freed_bytes[heap_kind_count];
+} heap = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static _Thread_local heap_cache thread_heap_cache;
+static pthread_key_t heap_cache_key;
+static pthread_once_t heap_cache_key_once = PTHREAD_ONCE_INIT;
+
+size_t heap_size_class_of(size_t size) {
+  return heap_size_classes[(size + 15) / 16];
+}
+
+heap_page *heap_page_of(void *block) {
+  return (heap_page *)((uintptr_t)block & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+size_t heap_blocks_per_page(size_t size_class) {
+  return (HEAP_PAGE_SIZE - HEAP_PAGE_HEADER_SIZE) /
+         heap_block_sizes[size_class];
+}
+
+// Must hold the heap lock.
+heap_page *create_heap_page(size_t size_class) {
+  heap_page *page = aligned_alloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+  if (!page)
+    return NULL;
+
+  size_t block_size = heap_block_sizes[size_class];
+  page->size_class = size_class;
+  page->live_count = 0;
+  page->is_sealed = 0;
+  page->free_list = NULL;
+  size_t block_count = (HEAP_PAGE_SIZE - HEAP_PAGE_HEADER_SIZE) / block_size;
+  for (size_t i = block_count; i > 0; i--) {
+    size_t offset = HEAP_PAGE_HEADER_SIZE + (i - 1) * block_size;
+    free_block *block = (free_block *)((char *)page + offset);
+    block->next = page->free_list;
+    page->free_list = block;
+  }
+
+  heap.page_count++;
+  heap.free_bytes += heap_blocks_per_page(size_class) * block_size;
+
+  heap_size_class *cls = &heap.classes[size_class];
+  page->next_page = cls->pages;
+  cls->pages = page;
+  page->next_available = cls->available;
+  page->is_available = 1;
+  cls->available = page;
+  return page;
+}
+
+// Must hold the heap lock.
+void return_heap_block(free_block *block) {
+  heap_page *page = heap_page_of(block);
+  block->next = page->free_list;
+  page->free_list = block;
+  page->live_count--;
+  heap.free_bytes += heap_block_sizes[page->size_class];
+  if (!page->is_available && !page->is_sealed) {
+    heap_size_class *cls = &heap.classes[page->size_class];
+    page->next_available = cls->available;
+    page->is_available = 1;
+    cls->available = page;
+  }
+}
+
+void flush_heap_cache(heap_cache *cache, size_t size_class, size_t keep) {
+  pthread_mutex_lock(&heap.lock);
+  while (cache->counts[size_class] > keep) {
+    free_block *block = cache->blocks[size_class];
+    cache->blocks[size_class] = block->next;
+    cache->counts[size_class]--;
+    return_heap_block(block);
+  }
+  pthread_mutex_unlock(&heap.lock);
+}
+
+size_t load_counter(atomic_size_t *counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+void bump_counter(atomic_size_t *counter, size_t amount) {
+  atomic_store_explicit(counter, load_counter(counter) + amount,
+                        memory_order_relaxed);
+}
+
+void drain_heap_cache(heap_cache *cache);
+
+// Hands the cached blocks back to their pages and keeps the counters when the
+// thread exits.
+void release_thread_heap_cache(void *data) {
+  heap_cache *cache = data;
+  drain_heap_cache(cache);
+
+  pthread_mutex_lock(&heap.lock);
+  heap_cache **link = &heap.caches;
+  while (*link != cache)
+    link = &(*link)->next_cache;
+  *link = cache->next_cache;
+
+  heap_counters *counters = &cache->counters;
+  for (size_t i = 0; i < heap_kind_count; i++) {
+    heap.exited_allocated[i] += load_counter(&counters->allocated[i]);
+    heap.exited_freed[i] += load_counter(&counters->freed[i]);
+    heap.exited_allocated_bytes[i] +=
+        load_counter(&counters->allocated_bytes[i]);
+    heap.exited_freed_bytes[i] += load_counter(&counters->freed_bytes[i]);
+  }
+  pthread_mutex_unlock(&heap.lock);
+}
+
+void create_heap_cache_key() {
+  pthread_key_create(&heap_cache_key, release_thread_heap_cache);
+}
+
+heap_cache *current_heap_cache() {
+  heap_cache *cache = &thread_heap_cache;
+  if (!cache->is_registered) {
+    pthread_once(&heap_cache_key_once, create_heap_cache_key);
+    pthread_setspecific(heap_cache_key, cache);
+    cache->is_registered = 1;
+
+    pthread_mutex_lock(&heap.lock);
+    cache->next_cache = heap.caches;
+    heap.caches = cache;
+    pthread_mutex_unlock(&heap.lock);
+  }
+  return cache;
+}
+
+int refill_heap_cache(heap_cache *cache, size_t size_class) {
+  pthread_mutex_lock(&heap.lock);
+  heap_size_class *cls = &heap.classes[size_class];
+  while (cache->counts[size_class] < HEAP_CACHE_BATCH) {
+    heap_page *page = cls->available;
+    if (!page && !(page = create_heap_page(size_class)))
+      break;
+
+    free_block *block = page->free_list;
+    page->free_list = block->next;
+    page->live_count++;
+    heap.free_bytes -= heap_block_sizes[size_class];
+    if (!page->free_list) {
+      cls->available = page->next_available;
+      page->is_available = 0;
+    }
+
+    block->next = cache->blocks[size_class];
+    cache->blocks[size_class] = block;
+    cache->counts[size_class]++;
+  }
+  pthread_mutex_unlock(&heap.lock);
+  return cache->counts[size_class] > 0;
+}
+
+void drain_heap_cache(heap_cache *cache) {
+  for (size_t i = 0; i < HEAP_SIZE_CLASS_COUNT; i++) {
+    flush_heap_cache(cache, i, 0);
+  }
+}
+
+void *heap_allocate(heap_kind kind, size_t size) {
+  heap_cache *cache = current_heap_cache();
+  size_t seal_epoch =
+      atomic_load_explicit(&heap.seal_epoch, memory_order_relaxed);
+  if (cache->seal_epoch != seal_epoch) {
+    // Blocks cached before the seal may sit on sealed pages.
+    drain_heap_cache(cache);
+    cache->seal_epoch = seal_epoch;
+  }
+  bump_counter(&cache->counters.allocated[kind], 1);
+  bump_counter(&cache->counters.allocated_bytes[kind], size);
+  if (size > HEAP_MAX_BLOCK_SIZE)
+    return malloc(size);
+
+  size_t size_class = heap_size_class_of(size);
+  if (!cache->blocks[size_class] && !refill_heap_cache(cache, size_class))
+    return NULL;
+
+  free_block *block = cache->blocks[size_class];
+  cache->blocks[size_class] = block->next;
+  cache->counts[size_class]--;
+  return block;
+}
+
+// `kind` and `size` must be the ones the block was allocated with.
+void heap_free(heap_kind kind, void *ptr, size_t size) {
+  heap_cache *cache = current_heap_cache();
+  bump_counter(&cache->counters.freed[kind], 1);
+  bump_counter(&cache->counters.freed_bytes[kind], size);
+  if (size > HEAP_MAX_BLOCK_SIZE) {
+    free(ptr);
+    return;
+  }
+
+  size_t size_class = heap_size_class_of(size);
+  free_block *block = ptr;
+  block->next = cache->blocks[size_class];
+  cache->blocks[size_class] = block;
+  if (++cache->counts[size_class] > 2 * HEAP_CACHE_BATCH)
+    flush_heap_cache(cache, size_class, HEAP_CACHE_BATCH);
+}
+
+// Strings keep the size of their block in front of their characters: they
+// may contain NUL bytes, so strlen can't be trusted to find it again.
+char *heap_allocate_string(size_t length) {
+  size_t size = sizeof(size_t) + length + 1;
+  size_t *block = heap_allocate(heap_kind_string, size);
+  *block = size;
+  return (char *)(block + 1);
+}
+
+// Bytes taken by the string, including its size and terminator.
+size_t heap_string_size(const char *string) {
+  return ((const size_t *)string)[-1];
+}
+
+char *heap_strndup(const char *string, size_t length) {
+  char *copy = heap_allocate_string(length);
+  memcpy(copy, string, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+char *heap_strdup(const char *string) {
+  return heap_strndup(string, strlen(string));
+}
+
+void heap_free_string(char *string) {
+  size_t *block = (size_t *)string - 1;
+  heap_free(heap_kind_string, block, *block);
+}
+
+// Compacting a small heap would just hand pages back that get allocated again
+// right after.
+#define HEAP_COMPACTION_MIN_FREE_BYTES (16 * HEAP_PAGE_SIZE)
+
+// Percentage of page memory sitting unused on free lists, or 0 while that is
+// too little to be worth compacting.
+size_t heap_fragmentation() {
+  pthread_mutex_lock(&heap.lock);
+  size_t page_bytes = heap.page_count * HEAP_PAGE_SIZE;
+  size_t fragmentation = heap.free_bytes >= HEAP_COMPACTION_MIN_FREE_BYTES
+                             ? heap.free_bytes * 100 / page_bytes
+                             : 0;
+  pthread_mutex_unlock(&heap.lock);
+  return fragmentation;
+}
+
+typedef struct heap_kind_stats {
+  size_t count;
+  size_t bytes;
+} heap_kind_stats;
+
+// Live objects and bytes of every kind, summed over all threads.
+void collect_heap_stats(heap_kind_stats stats[heap_kind_count]) {
+  pthread_mutex_lock(&heap.lock);
+  for (size_t i = 0; i < heap_kind_count; i++) {
+    size_t allocated = heap.exited_allocated[i];
+    size_t freed = heap.exited_freed[i];
+    size_t allocated_bytes = heap.exited_allocated_bytes[i];
+    size_t freed_bytes = heap.exited_freed_bytes[i];
+    for (heap_cache *cache = heap.caches; cache; cache = cache->next_cache) {
+      allocated += load_counter(&cache->counters.allocated[i]);
+      freed += load_counter(&cache->counters.freed[i]);
+      allocated_bytes += load_counter(&cache->counters.allocated_bytes[i]);
+      freed_bytes += load_counter(&cache->counters.freed_bytes[i]);
+    }
+    stats[i].count = allocated - freed;
+    stats[i].bytes = allocated_bytes - freed_bytes;
+  }
+  pthread_mutex_unlock(&heap.lock);
+}
+
+typedef struct heap_compaction {
+  size_t bytes_reclaimed;
+  uint64_t duration_us;
+} heap_compaction;
+
+uint64_t monotonic_microseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Gives pages without live blocks back to the system. Blocks are never moved:
+// the interpreter and its host hold plain pointers to them, so every block is
+// effectively pinned and only fully free pages can be reclaimed. The calling
+// thread's cache is drained first so its blocks don't keep pages alive; other
+// threads' caches are left alone.
+heap_compaction compact_heap() {
+  uint64_t start = monotonic_microseconds();
+  heap_cache *cache = current_heap_cache();
+  drain_heap_cache(cache);
+
+  heap_compaction compaction = {0, 0};
+  pthread_mutex_lock(&heap.lock);
+  for (size_t i = 0; i < HEAP_SIZE_CLASS_COUNT; i++) {
+    heap_size_class *cls = &heap.classes[i];
+    heap_page **link = &cls->pages;
+    cls->available = NULL;
+    while (*link) {
+      heap_page *page = *link;
+      if (page->live_count > 0) {
+        page->is_available = page->free_list != NULL && !page->is_sealed;
+        if (page->is_available) {
+          page->next_available = cls->available;
+          cls->available = page;
+        }
+        link = &page->next_page;
+        continue;
+      }
+
+      *link = page->next_page;
+      heap.page_count--;
+      heap.free_bytes -= heap_blocks_per_page(i) * heap_block_sizes[i];
+      compaction.bytes_reclaimed += HEAP_PAGE_SIZE;
+      free(page);
+    }
+  }
+  pthread_mutex_unlock(&heap.lock);
+
+  compaction.duration_us = monotonic_microseconds() - start;
+  return compaction;
+}
+
+// Stops allocating from every existing page, so the objects on them can be
+// shared with forked processes without allocations in those processes writing
+// to the pages' free lists and headers. Blocks freed later only get reused
+// while they sit in a thread cache; once back on their sealed page they stay
+// unused until the whole page is free and compacted away. Every thread drains
+// its cache before its next allocation.
+void seal_heap_pages() {
+  drain_heap_cache(current_heap_cache());
+
+  pthread_mutex_lock(&heap.lock);
+  for (size_t i = 0; i < HEAP_SIZE_CLASS_COUNT; i++) {
+    heap_size_class *cls = &heap.classes[i];
+    for (heap_page *page = cls->pages; page; page = page->next_page) {
+      page->is_sealed = 1;
+      page->is_available = 0;
+    }
+    cls->available = NULL;
+  }
+  atomic_fetch_add_explicit(&heap.seal_epoch, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&heap.lock);
+}
 
 typedef enum {
   node_type_int,
@@ -33,16 +484,235 @@ typedef enum {
   node_type_string,
   node_type_list
 } node_type;
-typedef enum { value_type_int, value_type_string } value_type;
+typedef enum {
+  value_type_int,
+  value_type_string,
+  value_type_function,
+  value_type_handle,
+  value_type_weak_ref,
+  value_type_bytevector,
+  value_type_sketch,
+  value_type_matcher,
+  value_type_vector
+} value_type;
 
 typedef struct value {
   value_type type;
   union {
     int int_value;
     char *string_value;
+    struct function *function_value;
+    struct handle *handle_value;
+    struct weak_ref *weak_ref_value;
+    struct bytevector *bytevector_value;
+    struct sketch *sketch_value;
+    struct matcher *matcher_value;
+    struct vector *vector_value;
   };
 } value;
 
+// Functions keep their parsed body around, so calling one never reparses
+// its definition. They're shared between every value that refers to them,
+// possibly from several threads when they live in a shared prelude.
+typedef struct function {
+  atomic_size_t refcount;
+  // Set when the context that defined the function is frozen. From then on
+  // the reference count is left alone and the frozen context frees the
+  // function, so handing it out never writes to its memory and forked
+  // workers keep sharing its pages.
+  int is_immortal;
+  char *name;
+  char **parameters;
+  size_t parameter_count;
+  struct ast_node **body;
+  size_t body_length;
+  // Profile for tiered execution: calls are counted, and the argument types
+  // recorded, until the function is as compiled as it gets.
+  atomic_size_t call_count;
+  atomic_int saw_non_int_argument;
+  _Atomic(struct function_code *) code; // NULL while interpreted
+} function;
+
+void release_function(function *fn);
+void free_function_code(struct function_code *code);
+
+typedef void (*handle_finalizer)(void *data);
+
+// Handles whose last reference went away. Their finalizers run in a batch at
+// the next safe point instead of in the middle of an evaluation.
+typedef struct finalization_queue {
+  pthread_mutex_t lock;
+  struct handle *pending;
+  size_t finalized_count;
+} finalization_queue;
+
+// Resource owned by the host, such as a file or a cache entry, that scripts
+// can pass around. Handles and weak refs are rare, so their reference counts
+// are simply guarded by the queue's lock.
+typedef struct handle {
+  size_t refcount;
+  int is_immortal; // see function
+  void *data;
+  handle_finalizer finalizer;
+  finalization_queue *queue;
+  struct weak_ref *weak_ref; // shared by all weak refs to this handle
+  struct handle *next_pending;
+} handle;
+
+// Refers to a handle without keeping it alive. The target is cleared when the
+// handle's last reference goes away.
+typedef struct weak_ref {
+  size_t refcount;
+  handle *target;
+  finalization_queue *queue;
+} weak_ref;
+
+// Releases bytes that weren't allocated by the interpreter, such as a mapped
+// file or a buffer lent by the host.
+typedef void (*byte_storage_release)(void *data, size_t length,
+                                     void *host_data);
+
+// Bytes shared by a bytevector and all of its slices. They're never written
+// once created, so any thread may read them.
+typedef struct byte_storage {
+  atomic_size_t refcount;
+  unsigned char *data;
+  size_t length;
+  byte_storage_release release; // NULL for bytes from heap_allocate
+  void *host_data;
+} byte_storage;
+
+// Read-only view of a range of a storage. Slicing creates another view of the
+// same bytes instead of copying them.
+typedef struct bytevector {
+  atomic_size_t refcount;
+  int is_immortal; // see function
+  byte_storage *storage;
+  const unsigned char *data;
+  size_t length;
+} bytevector;
+
+typedef enum {
+  sketch_kind_hyperloglog, // distinct count
+  sketch_kind_count_min,   // frequency of an item
+  sketch_kind_bloom_filter // membership
+} sketch_kind;
+
+// Fixed size summary of the items added to it. The cells are one flat array
+// of bytes, 32-bit counters or 64-bit words, so merging two sketches is a
+// single loop over both arrays. Several threads may add to a sketch at once.
+typedef struct sketch {
+  atomic_size_t refcount;
+  int is_immortal; // see function, and adding isn't allowed anymore
+  sketch_kind kind;
+  size_t width;      // cells per row, a power of two
+  size_t depth;      // rows of a count-min sketch
+  size_t hash_count; // bits set per item in a bloom filter
+  size_t cell_bytes; // of all cells
+  void *cells;
+} sketch;
+
+// Aho-Corasick automaton that finds every occurrence of a set of patterns in
+// one pass over a text. Bytes that appear in the same patterns share a class,
+// and every state has a transition for every class, so scanning costs one
+// table lookup per byte and never follows failure links. It's never changed
+// once built, so any thread may scan with it.
+typedef struct matcher {
+  atomic_size_t refcount;
+  int is_immortal; // see function
+  size_t pattern_count;
+  size_t state_count;
+  size_t class_count;
+  uint16_t byte_classes[256]; // 0 for bytes in no pattern
+  int32_t *transitions;       // class_count per state
+  int32_t *outputs;           // per state, the pattern ending there or -1
+  // Per state, the nearest state with an output on its failure chain or -1.
+  int32_t *output_links;
+  // Bytes that start a pattern. Outside of a partial match everything else
+  // is skipped without touching the automaton.
+  unsigned char first_bytes[256];
+  int only_first_byte; // the single byte starting every pattern, or -1
+} matcher;
+
+// Array of values owned by the vector, the rows and columns of the sorting
+// and aggregation builtins. sort! reorders the items in place, which a frozen
+// vector refuses, since its items are shared.
+typedef struct vector {
+  atomic_size_t refcount;
+  int is_immortal; // see function
+  value *items;
+  size_t length;
+} vector;
+
+// Must hold the queue's lock.
+void drop_weak_ref_locked(weak_ref *ref) {
+  if (--ref->refcount > 0)
+    return;
+
+  if (ref->target)
+    ref->target->weak_ref = NULL;
+  heap_free(heap_kind_weak_ref, ref, sizeof(weak_ref));
+}
+
+void retain_handle(handle *h) {
+  if (h->is_immortal)
+    return;
+
+  pthread_mutex_lock(&h->queue->lock);
+  h->refcount++;
+  pthread_mutex_unlock(&h->queue->lock);
+}
+
+void release_handle(handle *h) {
+  if (h->is_immortal)
+    return;
+
+  finalization_queue *queue = h->queue;
+  pthread_mutex_lock(&queue->lock);
+  if (--h->refcount == 0) {
+    if (h->weak_ref) {
+      h->weak_ref->target = NULL;
+      drop_weak_ref_locked(h->weak_ref);
+      h->weak_ref = NULL;
+    }
+    h->next_pending = queue->pending;
+    queue->pending = h;
+  }
+  pthread_mutex_unlock(&queue->lock);
+}
+
+void release_weak_ref(weak_ref *ref) {
+  finalization_queue *queue = ref->queue;
+  pthread_mutex_lock(&queue->lock);
+  drop_weak_ref_locked(ref);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+void finalize_handle(handle *h) {
+  if (h->finalizer)
+    h->finalizer(h->data);
+  heap_free(heap_kind_handle, h, sizeof(handle));
+}
+
+// Runs the finalizers of every handle released since the last call and
+// returns how many ran.
+size_t run_finalizers(finalization_queue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  handle *pending = queue->pending;
+  queue->pending = NULL;
+  pthread_mutex_unlock(&queue->lock);
+
+  size_t count = 0;
+  while (pending) {
+    handle *next = pending->next_pending;
+    finalize_handle(pending);
+    pending = next;
+    count++;
+  }
+  queue->finalized_count += count;
+  return count;
+}
+
 value create_int_value(int int_value) {
   value val;
   val.type = value_type_int;
@@ -53,21 +723,340 @@ value create_int_value(int int_value) {
 value create_string_value(const char *string) {
   value val;
   val.type = value_type_string;
-  val.string_value = strdup(string);
+  val.string_value = heap_strdup(string);
+  return val;
+}
+
+value create_function_value(function *fn) {
+  value val;
+  val.type = value_type_function;
+  val.function_value = fn;
+  return val;
+}
+
+value create_handle_value(finalization_queue *queue, void *data,
+                          handle_finalizer finalizer) {
+  handle *h = heap_allocate(heap_kind_handle, sizeof(handle));
+  h->refcount = 1;
+  h->is_immortal = 0;
+  h->data = data;
+  h->finalizer = finalizer;
+  h->queue = queue;
+  h->weak_ref = NULL;
+  h->next_pending = NULL;
+
+  value val;
+  val.type = value_type_handle;
+  val.handle_value = h;
+  return val;
+}
+
+value create_weak_ref_value(handle *target) {
+  finalization_queue *queue = target->queue;
+  pthread_mutex_lock(&queue->lock);
+  weak_ref *ref = target->weak_ref;
+  if (!ref) {
+    ref = heap_allocate(heap_kind_weak_ref, sizeof(weak_ref));
+    ref->refcount = 1; // held by the handle
+    ref->target = target;
+    ref->queue = queue;
+    target->weak_ref = ref;
+  }
+  ref->refcount++;
+  pthread_mutex_unlock(&queue->lock);
+
+  value val;
+  val.type = value_type_weak_ref;
+  val.weak_ref_value = ref;
+  return val;
+}
+
+// Returns 1 and a new reference to the target in `target` if it's alive.
+int get_weak_ref_target(weak_ref *ref, value *target) {
+  pthread_mutex_lock(&ref->queue->lock);
+  handle *h = ref->target;
+  if (h && !h->is_immortal)
+    h->refcount++;
+  pthread_mutex_unlock(&ref->queue->lock);
+
+  if (!h)
+    return 0;
+  target->type = value_type_handle;
+  target->handle_value = h;
+  return 1;
+}
+
+// Takes ownership of the storage reference.
+value create_bytevector_view(byte_storage *storage, const unsigned char *data,
+                             size_t length) {
+  bytevector *bv = heap_allocate(heap_kind_bytevector, sizeof(bytevector));
+  atomic_init(&bv->refcount, 1);
+  bv->is_immortal = 0;
+  bv->storage = storage;
+  bv->data = data;
+  bv->length = length;
+
+  value val;
+  val.type = value_type_bytevector;
+  val.bytevector_value = bv;
+  return val;
+}
+
+// Wraps bytes owned by the host without copying them. `release` is called
+// once no bytevector refers to them anymore.
+value create_host_bytevector_value(void *data, size_t length,
+                                   byte_storage_release release,
+                                   void *host_data) {
+  byte_storage *storage =
+      heap_allocate(heap_kind_bytevector, sizeof(byte_storage));
+  atomic_init(&storage->refcount, 1);
+  storage->data = data;
+  storage->length = length;
+  storage->release = release;
+  storage->host_data = host_data;
+  return create_bytevector_view(storage, data, length);
+}
+
+value create_bytevector_value(const void *data, size_t length) {
+  unsigned char *copy = heap_allocate(heap_kind_bytevector, length);
+  memcpy(copy, data, length);
+  return create_host_bytevector_value(copy, length, NULL, NULL);
+}
+
+// Shares the bytes of `bv` from `start` up to `end`, which must be in range.
+value slice_bytevector(bytevector *bv, size_t start, size_t end) {
+  atomic_fetch_add_explicit(&bv->storage->refcount, 1, memory_order_relaxed);
+  return create_bytevector_view(bv->storage, bv->data + start, end - start);
+}
+
+void destroy_bytevector(bytevector *bv) {
+  byte_storage *storage = bv->storage;
+  heap_free(heap_kind_bytevector, bv, sizeof(bytevector));
+  if (atomic_fetch_sub_explicit(&storage->refcount, 1,
+                                memory_order_acq_rel) != 1)
+    return;
+
+  if (storage->release) {
+    storage->release(storage->data, storage->length, storage->host_data);
+  } else {
+    heap_free(heap_kind_bytevector, storage->data, storage->length);
+  }
+  heap_free(heap_kind_bytevector, storage, sizeof(byte_storage));
+}
+
+void release_bytevector(bytevector *bv) {
+  if (bv->is_immortal)
+    return;
+
+  if (atomic_fetch_sub_explicit(&bv->refcount, 1, memory_order_acq_rel) == 1)
+    destroy_bytevector(bv);
+}
+
+// `width` must be a power of two. HyperLogLogs have one byte per cell,
+// count-min sketches a 32-bit counter and bloom filters 64 bits.
+size_t sketch_cell_bytes(sketch_kind kind, size_t width, size_t depth) {
+  return kind == sketch_kind_hyperloglog ? width
+         : kind == sketch_kind_count_min ? width * depth * sizeof(uint32_t)
+                                         : width / 64 * sizeof(uint64_t);
+}
+
+value create_sketch_value(sketch_kind kind, size_t width, size_t depth,
+                          size_t hash_count) {
+  sketch *s = heap_allocate(heap_kind_sketch, sizeof(sketch));
+  atomic_init(&s->refcount, 1);
+  s->is_immortal = 0;
+  s->kind = kind;
+  s->width = width;
+  s->depth = depth;
+  s->hash_count = hash_count;
+  s->cell_bytes = sketch_cell_bytes(kind, width, depth);
+  s->cells = heap_allocate(heap_kind_sketch, s->cell_bytes);
+  memset(s->cells, 0, s->cell_bytes);
+
+  value val;
+  val.type = value_type_sketch;
+  val.sketch_value = s;
+  return val;
+}
+
+void destroy_sketch(sketch *s) {
+  heap_free(heap_kind_sketch, s->cells, s->cell_bytes);
+  heap_free(heap_kind_sketch, s, sizeof(sketch));
+}
+
+void release_sketch(sketch *s) {
+  if (s->is_immortal)
+    return;
+
+  if (atomic_fetch_sub_explicit(&s->refcount, 1, memory_order_acq_rel) == 1)
+    destroy_sketch(s);
+}
+
+void destroy_matcher(matcher *m) {
+  heap_free(heap_kind_matcher, m->transitions,
+            sizeof(int32_t) * m->state_count * m->class_count);
+  heap_free(heap_kind_matcher, m->outputs, sizeof(int32_t) * m->state_count);
+  heap_free(heap_kind_matcher, m->output_links,
+            sizeof(int32_t) * m->state_count);
+  heap_free(heap_kind_matcher, m, sizeof(matcher));
+}
+
+void release_matcher(matcher *m) {
+  if (m->is_immortal)
+    return;
+
+  if (atomic_fetch_sub_explicit(&m->refcount, 1, memory_order_acq_rel) == 1)
+    destroy_matcher(m);
+}
+
+// Takes ownership of the `length` items, which may be NULL when empty.
+value create_vector_value(value *items, size_t length) {
+  vector *v = heap_allocate(heap_kind_vector, sizeof(vector));
+  atomic_init(&v->refcount, 1);
+  v->is_immortal = 0;
+  v->items = items;
+  v->length = length;
+
+  value val;
+  val.type = value_type_vector;
+  val.vector_value = v;
   return val;
 }
 
+value *allocate_vector_items(size_t length) {
+  return heap_allocate(heap_kind_vector, sizeof(value) * length);
+}
+
+void free_value(value val);
+
+void destroy_vector(vector *v) {
+  for (size_t i = 0; i < v->length; i++) {
+    free_value(v->items[i]);
+  }
+  if (v->items)
+    heap_free(heap_kind_vector, v->items, sizeof(value) * v->length);
+  heap_free(heap_kind_vector, v, sizeof(vector));
+}
+
+void release_vector(vector *v) {
+  if (v->is_immortal)
+    return;
+
+  if (atomic_fetch_sub_explicit(&v->refcount, 1, memory_order_acq_rel) == 1)
+    destroy_vector(v);
+}
+
 void free_value(value val) {
   if (val.type == value_type_string) {
-    free(val.string_value);
+    heap_free_string(val.string_value);
+  } else if (val.type == value_type_function) {
+    release_function(val.function_value);
+  } else if (val.type == value_type_handle) {
+    release_handle(val.handle_value);
+  } else if (val.type == value_type_weak_ref) {
+    release_weak_ref(val.weak_ref_value);
+  } else if (val.type == value_type_bytevector) {
+    release_bytevector(val.bytevector_value);
+  } else if (val.type == value_type_sketch) {
+    release_sketch(val.sketch_value);
+  } else if (val.type == value_type_matcher) {
+    release_matcher(val.matcher_value);
+  } else if (val.type == value_type_vector) {
+    release_vector(val.vector_value);
+  }
+}
+
+value copy_value(value val) {
+  if (val.type == value_type_string) {
+    return create_string_value(val.string_value);
+  } else if (val.type == value_type_function &&
+             !val.function_value->is_immortal) {
+    atomic_fetch_add_explicit(&val.function_value->refcount, 1,
+                              memory_order_relaxed);
+  } else if (val.type == value_type_handle) {
+    retain_handle(val.handle_value);
+  } else if (val.type == value_type_weak_ref) {
+    pthread_mutex_lock(&val.weak_ref_value->queue->lock);
+    val.weak_ref_value->refcount++;
+    pthread_mutex_unlock(&val.weak_ref_value->queue->lock);
+  } else if (val.type == value_type_bytevector &&
+             !val.bytevector_value->is_immortal) {
+    atomic_fetch_add_explicit(&val.bytevector_value->refcount, 1,
+                              memory_order_relaxed);
+  } else if (val.type == value_type_sketch &&
+             !val.sketch_value->is_immortal) {
+    atomic_fetch_add_explicit(&val.sketch_value->refcount, 1,
+                              memory_order_relaxed);
+  } else if (val.type == value_type_matcher &&
+             !val.matcher_value->is_immortal) {
+    atomic_fetch_add_explicit(&val.matcher_value->refcount, 1,
+                              memory_order_relaxed);
+  } else if (val.type == value_type_vector &&
+             !val.vector_value->is_immortal) {
+    atomic_fetch_add_explicit(&val.vector_value->refcount, 1,
+                              memory_order_relaxed);
+  }
+  return val;
+}
+
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Writes the decimal digits of `number` two at a time from the end of
+// `buffer`, which needs room for 11 characters, and returns where they start.
+char *format_int(int number, char *buffer) {
+  char *end = buffer + 11;
+  char *start = end;
+  // Negating INT_MIN overflows an int but not its unsigned magnitude.
+  unsigned magnitude = number < 0 ? 0u - (unsigned)number : (unsigned)number;
+  while (magnitude >= 100) {
+    start -= 2;
+    memcpy(start, digit_pairs + magnitude % 100 * 2, 2);
+    magnitude /= 100;
+  }
+  if (magnitude >= 10) {
+    start -= 2;
+    memcpy(start, digit_pairs + magnitude * 2, 2);
+  } else {
+    *--start = (char)('0' + magnitude);
   }
+  if (number < 0)
+    *--start = '-';
+  return start;
 }
 
 void print_value(value val) {
   if (val.type == value_type_int) {
-    printf("%d", val.int_value);
+    char buffer[11];
+    char *digits = format_int(val.int_value, buffer);
+    fwrite(digits, 1, buffer + sizeof(buffer) - digits, stdout);
   } else if (val.type == value_type_string) {
     printf("\"%s\"", val.string_value);
+  } else if (val.type == value_type_function) {
+    printf("<function %s>", val.function_value->name);
+  } else if (val.type == value_type_handle) {
+    printf("<handle %p>", val.handle_value->data);
+  } else if (val.type == value_type_weak_ref) {
+    printf("<weak-ref>");
+  } else if (val.type == value_type_bytevector) {
+    printf("<bytevector %zu>", val.bytevector_value->length);
+  } else if (val.type == value_type_sketch) {
+    static const char *names[] = {"hyperloglog", "count-min", "bloom-filter"};
+    printf("<%s>", names[val.sketch_value->kind]);
+  } else if (val.type == value_type_matcher) {
+    printf("<matcher %zu>", val.matcher_value->pattern_count);
+  } else if (val.type == value_type_vector) {
+    printf("#(");
+    for (size_t i = 0; i < val.vector_value->length; i++) {
+      if (i > 0)
+        printf(" ");
+      print_value(val.vector_value->items[i]);
+    }
+    printf(")");
   } else {
     fprintf(stderr, "Unknown value type\n");
     exit(1);
@@ -76,6 +1065,8 @@ void print_value(value val) {
 
 typedef struct ast_node {
   node_type type;
+  int is_interned; // owned by an ast_interner and shared
+  uint64_t hash;   // structural hash, only set for interned nodes
   union {
     int int_value;
     char *symbol_value;
@@ -88,44 +1079,118 @@ typedef struct ast_node {
 } ast_node;
 
 ast_node *create_int_node(int value) {
-  ast_node *node = malloc(sizeof(ast_node));
+  ast_node *node = heap_allocate(heap_kind_ast_node, sizeof(ast_node));
   node->type = node_type_int;
+  node->is_interned = 0;
   node->int_value = value;
   return node;
 }
 
 ast_node *create_symbol_node(const char *value) {
-  ast_node *node = malloc(sizeof(ast_node));
+  ast_node *node = heap_allocate(heap_kind_ast_node, sizeof(ast_node));
   node->type = node_type_symbol;
-  node->symbol_value = strdup(value);
+  node->is_interned = 0;
+  node->symbol_value = heap_strdup(value);
   return node;
 }
 
 ast_node *create_string_node(const char *value) {
-  ast_node *node = malloc(sizeof(ast_node));
+  ast_node *node = heap_allocate(heap_kind_ast_node, sizeof(ast_node));
   node->type = node_type_string;
-  node->string_value = strdup(value);
+  node->is_interned = 0;
+  node->string_value = heap_strdup(value);
   return node;
 }
 
 ast_node *create_list_node(ast_node **items, size_t length) {
-  ast_node *node = malloc(sizeof(ast_node));
+  ast_node *node = heap_allocate(heap_kind_ast_node, sizeof(ast_node));
   node->type = node_type_list;
+  node->is_interned = 0;
   node->list.items = items;
   node->list.length = length;
   return node;
 }
 
 void free_ast_node(ast_node *node) {
+  if (node->is_interned)
+    return;
+
   if (node->type == node_type_symbol) {
-    free(node->symbol_value);
+    heap_free_string(node->symbol_value);
+  } else if (node->type == node_type_string) {
+    heap_free_string(node->string_value);
   } else if (node->type == node_type_list) {
     for (size_t i = 0; i < node->list.length; i++) {
       free_ast_node(node->list.items[i]);
     }
     free(node->list.items);
   }
-  free(node);
+  heap_free(heap_kind_ast_node, node, sizeof(ast_node));
+}
+
+// Interned nodes are immutable and outlive anything they're part of, so they
+// are shared rather than copied.
+ast_node *copy_ast_node(ast_node *node) {
+  if (node->is_interned) {
+    return node;
+  } else if (node->type == node_type_int) {
+    return create_int_node(node->int_value);
+  } else if (node->type == node_type_symbol) {
+    return create_symbol_node(node->symbol_value);
+  } else if (node->type == node_type_string) {
+    return create_string_node(node->string_value);
+  }
+
+  ast_node **items = malloc(sizeof(ast_node *) * node->list.length);
+  for (size_t i = 0; i < node->list.length; i++) {
+    items[i] = copy_ast_node(node->list.items[i]);
+  }
+  return create_list_node(items, node->list.length);
+}
+
+// Takes ownership of `parameters`, copies the body expressions.
+function *create_function(const char *name, char **parameters,
+                          size_t parameter_count, ast_node **body,
+                          size_t body_length) {
+  function *fn = heap_allocate(heap_kind_function, sizeof(function));
+  atomic_init(&fn->refcount, 1);
+  fn->is_immortal = 0;
+  fn->name = strdup(name);
+  fn->parameters = parameters;
+  fn->parameter_count = parameter_count;
+  fn->body = malloc(sizeof(ast_node *) * body_length);
+  for (size_t i = 0; i < body_length; i++) {
+    fn->body[i] = copy_ast_node(body[i]);
+  }
+  fn->body_length = body_length;
+  atomic_init(&fn->call_count, 0);
+  atomic_init(&fn->saw_non_int_argument, 0);
+  atomic_init(&fn->code, NULL);
+  return fn;
+}
+
+void destroy_function(function *fn) {
+  struct function_code *code = atomic_load(&fn->code);
+  if (code)
+    free_function_code(code);
+  for (size_t i = 0; i < fn->parameter_count; i++) {
+    free(fn->parameters[i]);
+  }
+  free(fn->parameters);
+  for (size_t i = 0; i < fn->body_length; i++) {
+    free_ast_node(fn->body[i]);
+  }
+  free(fn->body);
+  free(fn->name);
+  heap_free(heap_kind_function, fn, sizeof(function));
+}
+
+void release_function(function *fn) {
+  if (fn->is_immortal)
+    return;
+
+  if (atomic_fetch_sub_explicit(&fn->refcount, 1, memory_order_acq_rel) == 1)
+    destroy_function(fn);
 }
 
 typedef struct result {
@@ -154,9 +1219,7 @@ void free_result(result res) {
   if (res.is_error) {
     free(res.error_message);
   } else {
-    if (res.result_value.type == value_type_string) {
-      free(res.result_value.string_value);
-    }
+    free_value(res.result_value);
   }
 }
 
@@ -190,18 +1253,262 @@ void free_parse_result(parse_result res) {
   }
 }
 
-// TODO: Support utf8 encoded input
-parse_result parse(const char *input, size_t *pos) {
-  while (input[*pos] == ' ' || input[*pos] == '\n' || input[*pos] == '\t')
-    (*pos)++;
+uint64_t hash_bytes(const void *data, size_t length) {
+  const unsigned char *bytes = data;
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
 
-  if (input[*pos] == '(') {
-    (*pos)++;
-    ast_node **items = NULL;
+uint64_t hash_string(const char *string) {
+  return hash_bytes(string, strlen(string));
+}
+
+uint64_t mix_hash(uint64_t hash, uint64_t part) {
+  return (hash ^ part) * 1099511628211ULL;
+}
+
+// Spreads every input bit over the whole hash, for tables and sketches that
+// take bits from both ends of it.
+uint64_t finalize_hash(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  return hash ^ (hash >> 33);
+}
+
+uint64_t hash_key(int key) { return finalize_hash((uint32_t)key); }
+
+// Structural hash of a parsed form. Formatting and comments don't reach the
+// AST, so two sources that only differ in layout hash the same.
+uint64_t hash_ast_node(ast_node *node) {
+  if (node->is_interned)
+    return node->hash;
+
+  uint64_t hash = mix_hash(14695981039346656037ULL, node->type);
+  if (node->type == node_type_int) {
+    return mix_hash(hash, (uint64_t)node->int_value);
+  } else if (node->type == node_type_symbol) {
+    return mix_hash(hash, hash_string(node->symbol_value));
+  } else if (node->type == node_type_string) {
+    return mix_hash(hash, hash_string(node->string_value));
+  }
+
+  hash = mix_hash(hash, node->list.length);
+  for (size_t i = 0; i < node->list.length; i++) {
+    hash = mix_hash(hash, hash_ast_node(node->list.items[i]));
+  }
+  return hash;
+}
+
+// Table of hash-consed AST nodes. Interning a node whose children are all
+// interned returns the one node with the same structure, so repeated
+// subexpressions are stored once and equal subtrees are the same pointer.
+typedef struct ast_interner {
+  ast_node **slots;
+  size_t capacity;
+  size_t length;
+} ast_interner;
+
+ast_interner *create_ast_interner() { return calloc(1, sizeof(ast_interner)); }
+
+// Frees the node but not its children, which are interned.
+void free_interned_node(ast_node *node) {
+  if (node->type == node_type_symbol || node->type == node_type_string) {
+    heap_free_string(node->symbol_value);
+  } else if (node->type == node_type_list) {
+    free(node->list.items);
+  }
+  heap_free(heap_kind_ast_node, node, sizeof(ast_node));
+}
+
+void free_ast_interner(ast_interner *interner) {
+  for (size_t i = 0; i < interner->capacity; i++) {
+    if (interner->slots[i])
+      free_interned_node(interner->slots[i]);
+  }
+  free(interner->slots);
+  free(interner);
+}
+
+// Children are compared by identity since they're interned already.
+int interned_nodes_equal(ast_node *a, ast_node *b) {
+  if (a->type != b->type) {
+    return 0;
+  } else if (a->type == node_type_int) {
+    return a->int_value == b->int_value;
+  } else if (a->type == node_type_symbol || a->type == node_type_string) {
+    return strcmp(a->symbol_value, b->symbol_value) == 0;
+  }
+
+  if (a->list.length != b->list.length)
+    return 0;
+  for (size_t i = 0; i < a->list.length; i++) {
+    if (a->list.items[i] != b->list.items[i])
+      return 0;
+  }
+  return 1;
+}
+
+void insert_interned_node(ast_interner *interner, ast_node *node) {
+  size_t slot = node->hash & (interner->capacity - 1);
+  while (interner->slots[slot])
+    slot = (slot + 1) & (interner->capacity - 1);
+  interner->slots[slot] = node;
+}
+
+// Takes ownership of `node`, whose children must be interned, and returns
+// the interned node with its structure. A NULL interner returns `node`.
+ast_node *intern_ast_node(ast_interner *interner, ast_node *node) {
+  if (!interner)
+    return node;
+
+  if ((interner->length + 1) * 2 > interner->capacity) {
+    ast_node **old_slots = interner->slots;
+    size_t old_capacity = interner->capacity;
+    interner->capacity = old_capacity ? old_capacity * 2 : 256;
+    interner->slots = calloc(interner->capacity, sizeof(ast_node *));
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old_slots[i])
+        insert_interned_node(interner, old_slots[i]);
+    }
+    free(old_slots);
+  }
+
+  // Children hash in constant time: they are interned and keep their hash.
+  uint64_t hash = hash_ast_node(node);
+  size_t slot = hash & (interner->capacity - 1);
+  while (interner->slots[slot]) {
+    ast_node *existing = interner->slots[slot];
+    if (existing->hash == hash && interned_nodes_equal(existing, node)) {
+      free_interned_node(node);
+      return existing;
+    }
+    slot = (slot + 1) & (interner->capacity - 1);
+  }
+
+  node->is_interned = 1;
+  node->hash = hash;
+  interner->slots[slot] = node;
+  interner->length++;
+  return node;
+}
+
+// TODO: Support utf8 encoded input
+void skip_whitespace(const char *input, size_t *pos) {
+  while (1) {
+    while (input[*pos] == ' ' || input[*pos] == '\n' || input[*pos] == '\t' ||
+           input[*pos] == '\r')
+      (*pos)++;
+
+    if (input[*pos] != ';')
+      return;
+
+    while (input[*pos] != '\n' && input[*pos] != '\0')
+      (*pos)++;
+  }
+}
+
+int is_symbol_end(char c) {
+  return c == ' ' || c == '(' || c == ')' || c == '\n' || c == '\t' ||
+         c == '\r' || c == ';' || c == '\0';
+}
+
+// Converts eight ASCII digits with three multiplies instead of eight: adjacent
+// digits are combined into pairs, pairs into quads and quads into the result,
+// all within one 64-bit word.
+uint32_t parse_eight_digits(const char *digits) {
+  uint64_t word;
+  memcpy(&word, digits, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  word -= 0x3030303030303030ULL;
+  word = word * 10 + (word >> 8);
+  word = ((word & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)) +
+          ((word >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32))) >>
+         32;
+  return (uint32_t)word;
+}
+
+int hex_digit_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Parses a decimal, `0x` hexadecimal or `0b` binary literal into `value` and
+// returns NULL, or returns an error message. Hexadecimal and binary literals
+// may use all 32 bits, so 0xFFFFFFFF is -1.
+const char *parse_int_literal(const char *input, size_t *pos, int *value) {
+  char prefix = input[*pos] == '0' ? input[*pos + 1] : '\0';
+  if (prefix == 'x' || prefix == 'b') {
+    int bits = prefix == 'x' ? 4 : 1;
+    *pos += 2;
+    size_t start = *pos;
+    uint64_t magnitude = 0;
+    int digit;
+    while ((digit = hex_digit_value(input[*pos])) >= 0 && digit < 1 << bits) {
+      magnitude = magnitude << bits | (uint64_t)digit;
+      if (magnitude > UINT32_MAX)
+        return "Integer literal out of range";
+      (*pos)++;
+    }
+    if (*pos == start)
+      return "Integer literal has no digits";
+    *value = (int)(uint32_t)magnitude;
+    return NULL;
+  }
+
+  const char *digits = input + *pos;
+  while (input[*pos] >= '0' && input[*pos] <= '9')
+    (*pos)++;
+  size_t length = input + *pos - digits;
+  while (length > 1 && *digits == '0') {
+    digits++;
+    length--;
+  }
+  // Ten digits is the most an int can hold, which leaves one eight digit
+  // chunk at most.
+  if (length > 10)
+    return "Integer literal out of range";
+
+  uint64_t magnitude = 0;
+  if (length >= 8) {
+    magnitude = parse_eight_digits(digits);
+    digits += 8;
+    length -= 8;
+  }
+  while (length-- > 0)
+    magnitude = magnitude * 10 + (uint64_t)(*digits++ - '0');
+  if (magnitude > INT_MAX)
+    return "Integer literal out of range";
+  *value = (int)magnitude;
+  return NULL;
+}
+
+// Parses like parse(), but hash-conses every node into `interner`, which then
+// owns them.
+parse_result parse_interned(const char *input, size_t *pos,
+                            ast_interner *interner) {
+  skip_whitespace(input, pos);
+
+  if (input[*pos] == '(') {
+    (*pos)++;
+    ast_node **items = NULL;
     size_t length = 0;
 
+    skip_whitespace(input, pos);
     while (input[*pos] != ')' && input[*pos] != '\0') {
-      parse_result sub_result = parse(input, pos);
+      parse_result sub_result = parse_interned(input, pos, interner);
       if (sub_result.is_error) {
         for (size_t i = 0; i < length; i++) {
           free_ast_node(items[i]);
@@ -211,6 +1518,7 @@ parse_result parse(const char *input, size_t *pos) {
       }
       items = realloc(items, sizeof(ast_node *) * (length + 1));
       items[length++] = sub_result.node;
+      skip_whitespace(input, pos);
     }
 
     if (input[*pos] == '\0') {
@@ -222,14 +1530,15 @@ parse_result parse(const char *input, size_t *pos) {
     }
 
     (*pos)++;
-    return create_parse_success(create_list_node(items, length));
+    return create_parse_success(
+        intern_ast_node(interner, create_list_node(items, length)));
   } else if (input[*pos] >= '0' && input[*pos] <= '9') {
-    int value = 0;
-    while (input[*pos] >= '0' && input[*pos] <= '9') {
-      value = value * 10 + (input[*pos] - '0');
-      (*pos)++;
-    }
-    return create_parse_success(create_int_node(value));
+    int value;
+    const char *error = parse_int_literal(input, pos, &value);
+    if (error)
+      return create_parse_error(error);
+    return create_parse_success(
+        intern_ast_node(interner, create_int_node(value)));
   } else if (input[*pos] == '"') {
     (*pos)++;
     size_t start = *pos;
@@ -241,138 +1550,4958 @@ parse_result parse(const char *input, size_t *pos) {
     size_t length = *pos - start;
     char *string = strndup(input + start, length);
     (*pos)++;
-    return create_parse_success(create_string_node(string));
+    ast_node *node = create_string_node(string);
+    free(string);
+    return create_parse_success(intern_ast_node(interner, node));
+  } else if (input[*pos] == ')') {
+    return create_parse_error("Unexpected ')' in input");
   } else if (input[*pos] != '\0') {
     size_t start = *pos;
-    while (input[*pos] != ' ' && input[*pos] != ')' && input[*pos] != '\n' &&
-           input[*pos] != '\t') {
+    while (!is_symbol_end(input[*pos])) {
       (*pos)++;
     }
     char *symbol = strndup(input + start, *pos - start);
-    return create_parse_success(create_symbol_node(symbol));
+    ast_node *node = create_symbol_node(symbol);
+    free(symbol);
+    return create_parse_success(intern_ast_node(interner, node));
   }
 
   return create_parse_error("Unexpected end of input");
 }
 
-result eval_ast_node(ast_node *node) {
-  if (node->type == node_type_int) {
-    return create_success_result(create_int_value(node->int_value));
-  } else if (node->type == node_type_string) {
-    return create_success_result(create_string_value(node->symbol_value));
-  } else if (node->type == node_type_symbol) {
-    return create_error_result("Cannot evaluate a standalone symbol");
-  } else if (node->type == node_type_list) {
-    if (node->list.length == 0) {
-      return create_error_result("Cannot evaluate an empty list");
+parse_result parse(const char *input, size_t *pos) {
+  return parse_interned(input, pos, NULL);
+}
+
+typedef struct binding {
+  char *name; // NULL for an empty slot
+  value val;
+} binding;
+
+// Open addressing hash table with linear probing. Capacity is always a power
+// of two, so probing wraps with a mask instead of a division.
+typedef struct global_table {
+  binding *entries;
+  size_t capacity;
+  size_t length;
+} global_table;
+
+binding *find_global_slot(binding *entries, size_t capacity,
+                          const char *name) {
+  size_t index = hash_string(name) & (capacity - 1);
+  while (entries[index].name != NULL &&
+         strcmp(entries[index].name, name) != 0) {
+    index = (index + 1) & (capacity - 1);
+  }
+  return &entries[index];
+}
+
+value *lookup_global(const global_table *table, const char *name) {
+  if (table->capacity == 0)
+    return NULL;
+
+  binding *slot = find_global_slot(table->entries, table->capacity, name);
+  return slot->name != NULL ? &slot->val : NULL;
+}
+
+// Takes ownership of `val`. When `name` was already bound, the previous value
+// is moved to `replaced` and 1 is returned.
+int set_global(global_table *table, const char *name, value val,
+               value *replaced) {
+  if ((table->length + 1) * 2 > table->capacity) {
+    size_t capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+    binding *entries = calloc(capacity, sizeof(binding));
+    for (size_t i = 0; i < table->capacity; i++) {
+      if (table->entries[i].name != NULL) {
+        *find_global_slot(entries, capacity, table->entries[i].name) =
+            table->entries[i];
+      }
     }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+  }
 
-    ast_node *op = node->list.items[0];
-    if (op->type != node_type_symbol) {
-      return create_error_result(
-          "First element of a list must be a symbol (operator)");
+  binding *slot = find_global_slot(table->entries, table->capacity, name);
+  int is_replaced = slot->name != NULL;
+  if (is_replaced) {
+    *replaced = slot->val;
+  } else {
+    slot->name = strdup(name);
+    table->length++;
+  }
+  slot->val = val;
+  return is_replaced;
+}
+
+void free_global_table(global_table *table) {
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->entries[i].name != NULL) {
+      free(table->entries[i].name);
+      free_value(table->entries[i].val);
     }
+  }
+  free(table->entries);
+}
 
-    if (strcmp(op->symbol_value, "+") == 0) {
-      int sum = 0;
+// Function call frame. Names are borrowed from the function being called.
+typedef struct environment {
+  char **names;
+  value *values;
+  size_t length;
+} environment;
 
-      for (size_t i = 1; i < node->list.length; i++) {
-        result arg_result = eval_ast_node(node->list.items[i]);
+#define PAUSE_HISTOGRAM_BUCKETS 32
 
-        if (arg_result.is_error)
-          return arg_result;
+// Bucket `i` counts the pauses shorter than 2^i microseconds.
+typedef struct pause_stats {
+  size_t count;
+  uint64_t max_us;
+  size_t histogram[PAUSE_HISTOGRAM_BUCKETS];
+} pause_stats;
 
-        if (arg_result.result_value.type != value_type_int)
-          return create_error_result("Non-integer argument to +");
+void record_pause(pause_stats *stats, uint64_t pause_us) {
+  size_t bucket = 0;
+  while (bucket < PAUSE_HISTOGRAM_BUCKETS - 1 && (1ULL << bucket) <= pause_us)
+    bucket++;
+  stats->histogram[bucket]++;
+  stats->count++;
+  if (pause_us > stats->max_us)
+    stats->max_us = pause_us;
+}
 
-        sum += arg_result.result_value.int_value;
-        free_result(arg_result);
-      }
+// Upper bound of the bucket holding the 99th percentile pause.
+uint64_t pause_p99_microseconds(pause_stats *stats) {
+  size_t seen = 0;
+  for (size_t i = 0; i < PAUSE_HISTOGRAM_BUCKETS; i++) {
+    seen += stats->histogram[i];
+    if (seen * 100 >= stats->count * 99 && seen > 0)
+      return 1ULL << i;
+  }
+  return 0;
+}
 
-      return create_success_result(create_int_value(sum));
-    } else if (strcmp(op->symbol_value, "-") == 0) {
-      result arg_result = eval_ast_node(node->list.items[1]);
+// Values replaced by redefinitions. Freeing them right away would make a
+// reload of a big file pay for tearing down every old definition in one go,
+// so they are freed a slice at a time between evaluations instead.
+typedef struct retired_values {
+  value *values;
+  size_t length;
+  size_t capacity;
+} retired_values;
 
-      if (arg_result.is_error)
-        return arg_result;
+void retire_value(retired_values *retired, value val) {
+  if (retired->length == retired->capacity) {
+    retired->capacity = retired->capacity == 0 ? 64 : retired->capacity * 2;
+    retired->values =
+        realloc(retired->values, sizeof(value) * retired->capacity);
+  }
+  retired->values[retired->length++] = val;
+}
 
-      if (arg_result.result_value.type != value_type_int)
-        return create_error_result("Non-integer argument to +");
+// Source of one top-level form of a loaded file, remembered so that reloading
+// the file only parses and evaluates the forms that actually changed.
+typedef struct loaded_form {
+  char *source;
+  uint64_t source_hash;
+  uint64_t ast_hash;
+  int is_evaluated;
+} loaded_form;
 
-      int diff = arg_result.result_value.int_value;
-      free_result(arg_result);
+typedef struct loaded_file {
+  char *path;
+  loaded_form *forms;
+  size_t form_count;
+} loaded_file;
 
-      for (size_t i = 2; i < node->list.length; i++) {
-        result arg_result = eval_ast_node(node->list.items[i]);
+typedef struct builtin_info {
+  const char *name;
+  int is_sandbox_safe; // no I/O and no effects outside the evaluation
+  int is_pure;         // the result only depends on the arguments
+} builtin_info;
 
-        if (arg_result.is_error)
-          return arg_result;
+static const builtin_info builtin_infos[] = {
+    {"define", 0, 0},            {"load", 0, 0},
+    {"reclaim-stats", 0, 0},     {"weak-ref", 1, 1},
+    {"weak-get", 1, 0},          {"heap-stats", 0, 0},
+    {"heap-dump", 0, 0},         {"compact-heap", 0, 0},
+    {"+", 1, 1},                 {"-", 1, 1},
+    {"concat", 1, 1},            {"file-bytes", 0, 0},
+    {"string-bytes", 1, 1},      {"bytes-length", 1, 1},
+    {"bytes-slice", 1, 1},       {"bytes-varint", 1, 1},
+    {"bytes-varint-size", 1, 1}, {"bytes-u8", 1, 1},
+    {"bytes-s8", 1, 1},          {"bytes-u16-le", 1, 1},
+    {"bytes-u16-be", 1, 1},      {"bytes-s16-le", 1, 1},
+    {"bytes-s16-be", 1, 1},      {"bytes-u32-le", 1, 1},
+    {"bytes-u32-be", 1, 1},      {"bytes-s32-le", 1, 1},
+    {"bytes-s32-be", 1, 1},      {"bytes-u64-le", 1, 1},
+    {"bytes-u64-be", 1, 1},      {"bytes-s64-le", 1, 1},
+    {"bytes-s64-be", 1, 1},      {"for-each-line", 0, 0},
+    {"map-lines", 0, 0},         {"make-hyperloglog", 1, 0},
+    {"make-count-min", 1, 0},    {"make-bloom-filter", 1, 0},
+    {"sketch-add", 0, 0},        {"sketch-merge", 1, 0},
+    {"sketch-count", 1, 0},      {"sketch-contains", 1, 0},
+    {"make-matcher", 1, 1},      {"load-matcher", 0, 0},
+    {"matcher-scan", 1, 0},      {"matcher-find", 1, 1},
+    {"vector", 1, 0},            {"vector-length", 1, 0},
+    {"vector-ref", 1, 0},        {"sort", 1, 0},
+    {"sort!", 0, 0},             {"top-k", 1, 0},
+    {"group-by", 1, 0},          {"hash-join", 0, 0}};
 
-        if (arg_result.result_value.type != value_type_int)
-          return create_error_result("Non-integer argument to +");
+const builtin_info *find_builtin(const char *name) {
+  for (size_t i = 0; i < sizeof(builtin_infos) / sizeof(builtin_info); i++) {
+    if (strcmp(builtin_infos[i].name, name) == 0)
+      return &builtin_infos[i];
+  }
+  return NULL;
+}
 
-        diff -= arg_result.result_value.int_value;
-        free_result(arg_result);
-      }
+// Bounds on the cost of one evaluation of untrusted code. Zero means no limit.
+typedef struct sandbox_limits {
+  size_t fuel;         // evaluation steps
+  size_t memory_bytes; // growth of the evaluating thread's heap usage
+  uint64_t timeout_us;
+  // NULL terminated list of the builtins the code may use, or NULL for every
+  // builtin without I/O or effects outside the evaluation. Calls to functions
+  // defined by the host are always allowed.
+  const char **allowed_builtins;
+} sandbox_limits;
 
-      return create_success_result(create_int_value(diff));
-    } else if (strcmp(op->symbol_value, "concat") == 0) {
-      size_t total_length = 0;
-      for (size_t i = 1; i < node->list.length; i++) {
-        result arg_result = eval_ast_node(node->list.items[i]);
-        if (arg_result.is_error)
-          return arg_result;
+// Steps between two checks of the clock and the memory usage; calls always
+// check.
+#define SANDBOX_CHECK_INTERVAL 256
 
-        if (arg_result.result_value.type != value_type_string)
-          return create_error_result("Non-string argument to concat");
+typedef struct sandbox {
+  const sandbox_limits *limits;
+  size_t fuel_left;
+  uint64_t deadline_us;
+  size_t memory_baseline;
+  size_t steps_until_check;
+} sandbox;
 
-        total_length += strlen(arg_result.result_value.string_value);
-        free_result(arg_result);
-      }
+// Bytes the calling thread allocated minus the bytes it freed.
+size_t thread_heap_usage() {
+  heap_counters *counters = &current_heap_cache()->counters;
+  size_t usage = 0;
+  for (size_t i = 0; i < heap_kind_count; i++) {
+    usage += load_counter(&counters->allocated_bytes[i]) -
+             load_counter(&counters->freed_bytes[i]);
+  }
+  return usage;
+}
 
-      char *result_string = malloc(total_length + 1);
-      result_string[0] = '\0';
+// Growth of the heap usage since the sandbox started, or 0 when the
+// evaluation freed more than it allocated, as reclaiming retired values does.
+size_t sandbox_memory_usage(const sandbox *sb) {
+  int64_t growth = (int64_t)(thread_heap_usage() - sb->memory_baseline);
+  return growth > 0 ? (size_t)growth : 0;
+}
 
-      for (size_t i = 1; i < node->list.length; i++) {
-        result arg_result = eval_ast_node(node->list.items[i]);
-        strcat(result_string, arg_result.result_value.string_value);
-        free_result(arg_result);
-      }
+// Returns the reason the evaluation has to stop, or NULL.
+const char *check_sandbox(sandbox *sb, int is_safe_point) {
+  const sandbox_limits *limits = sb->limits;
+  if (limits->fuel) {
+    if (sb->fuel_left == 0)
+      return "Evaluation ran out of fuel";
+    sb->fuel_left--;
+  }
 
-      return create_success_result(create_string_value(result_string));
-    } else {
-      return create_error_result("Unknown operator");
-    }
+  if (!is_safe_point && --sb->steps_until_check > 0)
+    return NULL;
+  sb->steps_until_check = SANDBOX_CHECK_INTERVAL;
+
+  if (limits->timeout_us && monotonic_microseconds() >= sb->deadline_us)
+    return "Evaluation timed out";
+  if (limits->memory_bytes &&
+      sandbox_memory_usage(sb) > limits->memory_bytes)
+    return "Evaluation exceeded its memory limit";
+  return NULL;
+}
+
+// Checked before allocations whose size the evaluated code picks, so a large
+// one fails up front instead of at the next check after it was made.
+const char *reserve_sandbox_memory(const sandbox *sb, size_t bytes) {
+  size_t limit = sb ? sb->limits->memory_bytes : 0;
+  if (limit && (bytes > limit || sandbox_memory_usage(sb) > limit - bytes))
+    return "Evaluation exceeded its memory limit";
+  return NULL;
+}
+
+int sandbox_allows(sandbox *sb, const char *name) {
+  const builtin_info *builtin = find_builtin(name);
+  if (!builtin)
+    return 1;
+
+  if (!sb->limits->allowed_builtins)
+    return builtin->is_sandbox_safe;
+
+  for (const char **allowed = sb->limits->allowed_builtins; *allowed;
+       allowed++) {
+    if (strcmp(*allowed, name) == 0)
+      return 1;
   }
+  return 0;
+}
 
-  return create_error_result("Unknown AST node type");
+// Requests other threads can make to a running evaluation. They're served at
+// the next safe point, which is every function call.
+typedef enum {
+  interrupt_cancel = 1,  // stop the evaluation with an error
+  interrupt_reclaim = 2, // run a reclamation slice and pending finalizers
+  interrupt_sample = 4   // pass the current call stack to the sampler
+} interrupt_request;
+
+typedef struct call_frame {
+  const function *fn;
+  const struct call_frame *caller;
+} call_frame;
+
+typedef void (*stack_sampler)(const call_frame *top, void *data);
+
+// A context's own copy of an immortal function from its prelude.
+typedef struct function_copy {
+  const function *original;
+  function *copy;
+} function_copy;
+
+// What a previous run learned about the function of a given name.
+typedef struct function_profile {
+  char *name;
+  size_t call_count;
+  int saw_non_int_argument;
+} function_profile;
+
+// State of an interpreter session. Definitions persist across evaluations.
+//
+// A context can be frozen and then used as the prelude of any number of other
+// contexts, on any number of threads. The prelude is never written to after
+// freezing: lookups fall through to it, definitions go to the context's own
+// globals and shadow the prelude's ones. The prelude of a child context is
+// instead a parent that is paused while its children run.
+typedef struct context {
+  const struct context *prelude;
+  int is_frozen;
+  global_table globals;
+  // Functions and handles made immortal by freezing, freed along with the
+  // context.
+  value *immortal_values;
+  size_t immortal_value_count;
+  finalization_queue finalizers;
+  // While a file is being loaded, its definitions go here and are swapped
+  // into `globals` together once every form evaluated successfully.
+  global_table *staged_globals;
+  loaded_file *files;
+  size_t file_count;
+  // Files loaded by a file that is being loaded. Their forms only count as
+  // evaluated once the outermost load commits its definitions.
+  loaded_file *staged_files;
+  size_t staged_file_count;
+  retired_values retired;
+  uint64_t reclaim_budget_us; // time allowed per reclamation slice
+  pause_stats reclaim_pauses;
+  // The heap is compacted after a reclamation slice once this percentage of
+  // it is free. 0 disables compaction.
+  size_t compaction_threshold;
+  size_t compaction_count;
+  heap_compaction compaction_totals;
+  // Bumped by every definition, so anything derived from the globals can
+  // tell whether it is still current.
+  uint64_t definition_epoch;
+  // When set, code is parsed hash-consed and functions share their interned
+  // bodies instead of copying them. Interned nodes live as long as the
+  // context.
+  ast_interner *interner;
+  sandbox *sandbox; // set while evaluating sandboxed code
+  atomic_int interrupts; // pending interrupt_request flags
+  const call_frame *call_stack;
+  stack_sampler sampler;
+  void *sampler_data;
+  // Loaded by load_function_profiles, sorted by name. Functions defined with
+  // a profile start out at the tier it earned them.
+  function_profile *profiles;
+  size_t profile_count;
+  // Immortal functions aren't profiled, so the prelude functions the context
+  // calls are profiled and tiered up through copies of its own, by original.
+  function_copy *function_copies;
+  size_t function_copy_capacity; // power of two
+  size_t function_copy_count;
+} context;
+
+// May be called from any thread.
+void request_interrupt(context *ctx, interrupt_request request) {
+  atomic_fetch_or_explicit(&ctx->interrupts, request, memory_order_release);
 }
 
-void process_yalisp_shell_input(const char *input) {
-  size_t pos = 0;
-  parse_result parse_result = parse(input, &pos);
-  if (parse_result.is_error) {
-    printf("Error: %s\n", parse_result.error_message);
-    free_parse_result(parse_result);
+context *create_context() {
+  context *ctx = calloc(1, sizeof(context));
+  ctx->reclaim_budget_us = 500;
+  ctx->compaction_threshold = 50;
+  pthread_mutex_init(&ctx->finalizers.lock, NULL);
+  return ctx;
+}
+
+heap_compaction compact_context_heap(context *ctx) {
+  heap_compaction compaction = compact_heap();
+  ctx->compaction_count++;
+  ctx->compaction_totals.bytes_reclaimed += compaction.bytes_reclaimed;
+  ctx->compaction_totals.duration_us += compaction.duration_us;
+  return compaction;
+}
+
+// Frees retired values until they run out or the slice budget is spent, and
+// returns how many are left for the next slice.
+size_t reclaim_retired_values(context *ctx) {
+  if (ctx->retired.length == 0)
+    return 0;
+
+  uint64_t start = monotonic_microseconds();
+  size_t freed = 0;
+  while (ctx->retired.length > 0) {
+    free_value(ctx->retired.values[--ctx->retired.length]);
+    // Reading the clock costs more than freeing a small value.
+    if (++freed % 16 == 0 &&
+        monotonic_microseconds() - start >= ctx->reclaim_budget_us)
+      break;
+  }
+  record_pause(&ctx->reclaim_pauses, monotonic_microseconds() - start);
+
+  if (ctx->retired.length == 0 && ctx->compaction_threshold > 0 &&
+      heap_fragmentation() >= ctx->compaction_threshold)
+    compact_context_heap(ctx);
+  return ctx->retired.length;
+}
+
+// Functions defined from then on share their body with the interner, so they
+// must not outlive the context.
+void enable_hash_consing(context *ctx) {
+  if (!ctx->interner)
+    ctx->interner = create_ast_interner();
+}
+
+// `prelude` must be frozen and outlive the new context.
+context *create_overlay_context(const context *prelude) {
+  context *ctx = create_context();
+  ctx->prelude = prelude;
+  return ctx;
+}
+
+// Context for a thread evaluating on behalf of `parent`, which waits for it
+// and isn't used otherwise until the child is freed. Unlike a prelude the
+// parent needn't be frozen: the child sees its definitions, including the
+// ones staged by a load in progress, and makes its own.
+context *create_child_context(const context *parent) {
+  context *ctx = create_context();
+  ctx->prelude = parent;
+  return ctx;
+}
+
+struct function_code *install_baseline_code(function *fn);
+
+// Values of a frozen context are only ever read, including their reference
+// counts: its functions and handles become immortal and are freed with the
+// context, which therefore has to outlive every value handed out from it.
+// The heap pages holding them are sealed, so later allocations, including
+// those of forked workers, come from fresh pages.
+void make_immortal(context *ctx, value val) {
+  int *is_immortal = NULL;
+  if (val.type == value_type_function) {
+    // Immortal functions aren't profiled, since counting calls would write
+    // to their shared pages, so they get their baseline code right away.
+    // Contexts calling them profile copies instead, see profiled_function.
+    install_baseline_code(val.function_value);
+    is_immortal = &val.function_value->is_immortal;
+  } else if (val.type == value_type_handle) {
+    is_immortal = &val.handle_value->is_immortal;
+  } else if (val.type == value_type_bytevector) {
+    is_immortal = &val.bytevector_value->is_immortal;
+  } else if (val.type == value_type_sketch) {
+    is_immortal = &val.sketch_value->is_immortal;
+  } else if (val.type == value_type_matcher) {
+    is_immortal = &val.matcher_value->is_immortal;
+  } else if (val.type == value_type_vector) {
+    is_immortal = &val.vector_value->is_immortal;
+  }
+  if (is_immortal == NULL || *is_immortal)
     return;
+
+  *is_immortal = 1;
+  ctx->immortal_values = realloc(
+      ctx->immortal_values, sizeof(value) * (ctx->immortal_value_count + 1));
+  ctx->immortal_values[ctx->immortal_value_count++] = val;
+
+  // Reading an item copies it, which mustn't write to its reference count
+  // either.
+  if (val.type == value_type_vector) {
+    for (size_t i = 0; i < val.vector_value->length; i++) {
+      make_immortal(ctx, val.vector_value->items[i]);
+    }
   }
+}
 
-  result eval_result = eval_ast_node(parse_result.node);
-  if (eval_result.is_error) {
-    printf("Error: %s\n", eval_result.error_message);
-    free_parse_result(parse_result);
-    free_result(eval_result);
+void freeze_context(context *ctx) {
+  ctx->is_frozen = 1;
+  for (size_t i = 0; i < ctx->globals.capacity; i++) {
+    binding *entry = &ctx->globals.entries[i];
+    if (entry->name != NULL)
+      make_immortal(ctx, entry->val);
+  }
+  seal_heap_pages();
+}
+
+void free_loaded_file(loaded_file *file) {
+  for (size_t i = 0; i < file->form_count; i++) {
+    free(file->forms[i].source);
+  }
+  free(file->forms);
+  free(file->path);
+}
+
+void free_context(context *ctx) {
+  free_global_table(&ctx->globals);
+  // Vectors go first: releasing their items reads the items' immortal flags.
+  for (size_t i = 0; i < ctx->immortal_value_count; i++) {
+    value val = ctx->immortal_values[i];
+    if (val.type == value_type_vector)
+      destroy_vector(val.vector_value);
+  }
+  for (size_t i = 0; i < ctx->immortal_value_count; i++) {
+    value val = ctx->immortal_values[i];
+    if (val.type == value_type_vector) {
+      continue;
+    } else if (val.type == value_type_function) {
+      destroy_function(val.function_value);
+      continue;
+    } else if (val.type == value_type_bytevector) {
+      destroy_bytevector(val.bytevector_value);
+      continue;
+    } else if (val.type == value_type_sketch) {
+      destroy_sketch(val.sketch_value);
+      continue;
+    } else if (val.type == value_type_matcher) {
+      destroy_matcher(val.matcher_value);
+      continue;
+    }
+
+    // Dropping the last reference queues the handle for finalization below.
+    val.handle_value->is_immortal = 0;
+    val.handle_value->refcount = 1;
+    release_handle(val.handle_value);
+  }
+  free(ctx->immortal_values);
+  for (size_t i = 0; i < ctx->retired.length; i++) {
+    free_value(ctx->retired.values[i]);
+  }
+  free(ctx->retired.values);
+  run_finalizers(&ctx->finalizers);
+  pthread_mutex_destroy(&ctx->finalizers.lock);
+  for (size_t i = 0; i < ctx->file_count; i++) {
+    free_loaded_file(&ctx->files[i]);
+  }
+  free(ctx->files);
+  if (ctx->interner)
+    free_ast_interner(ctx->interner);
+  for (size_t i = 0; i < ctx->profile_count; i++) {
+    free(ctx->profiles[i].name);
+  }
+  free(ctx->profiles);
+  for (size_t i = 0; i < ctx->function_copy_capacity; i++) {
+    if (ctx->function_copies[i].copy)
+      release_function(ctx->function_copies[i].copy);
+  }
+  free(ctx->function_copies);
+  free(ctx);
+}
+
+typedef struct pointer_set {
+  const void **slots;
+  size_t capacity;
+  size_t length;
+} pointer_set;
+
+// Returns 1 if `ptr` wasn't in the set yet.
+int add_pointer(pointer_set *set, const void *ptr) {
+  if ((set->length + 1) * 2 > set->capacity) {
+    pointer_set grown = {NULL, set->capacity ? set->capacity * 2 : 256, 0};
+    grown.slots = calloc(grown.capacity, sizeof(void *));
+    for (size_t i = 0; i < set->capacity; i++) {
+      if (set->slots[i])
+        add_pointer(&grown, set->slots[i]);
+    }
+    free(set->slots);
+    *set = grown;
+  }
+
+  size_t slot = hash_bytes(&ptr, sizeof(ptr)) & (set->capacity - 1);
+  while (set->slots[slot] != NULL) {
+    if (set->slots[slot] == ptr)
+      return 0;
+    slot = (slot + 1) & (set->capacity - 1);
+  }
+  set->slots[slot] = ptr;
+  set->length++;
+  return 1;
+}
+
+typedef struct heap_dump {
+  FILE *file;
+  pointer_set visited;
+} heap_dump;
+
+void dump_edge(heap_dump *dump, const void *from, const void *to,
+               const char *strength) {
+  fprintf(dump->file, "edge %p %p %s\n", from, to, strength);
+}
+
+void dump_ast_node(heap_dump *dump, ast_node *node) {
+  if (!add_pointer(&dump->visited, node))
     return;
+
+  size_t bytes = sizeof(ast_node);
+  if (node->type == node_type_symbol || node->type == node_type_string) {
+    bytes += heap_string_size(node->symbol_value);
+  } else if (node->type == node_type_list) {
+    bytes += sizeof(ast_node *) * node->list.length;
+  }
+  fprintf(dump->file, "object %p ast-node %zu\n", (void *)node, bytes);
+
+  if (node->type == node_type_list) {
+    for (size_t i = 0; i < node->list.length; i++) {
+      dump_ast_node(dump, node->list.items[i]);
+      dump_edge(dump, node, node->list.items[i], "strong");
+    }
+  }
+}
+
+// Returns the id of the object holding the value, or NULL for values that
+// live inline, like integers.
+const void *dump_value(heap_dump *dump, value val) {
+  if (val.type == value_type_string) {
+    if (add_pointer(&dump->visited, val.string_value))
+      fprintf(dump->file, "object %p string %zu\n", (void *)val.string_value,
+              heap_string_size(val.string_value));
+    return val.string_value;
+  } else if (val.type == value_type_function) {
+    function *fn = val.function_value;
+    if (add_pointer(&dump->visited, fn)) {
+      size_t bytes = sizeof(function) + strlen(fn->name) + 1 +
+                     sizeof(ast_node *) * fn->body_length;
+      for (size_t i = 0; i < fn->parameter_count; i++)
+        bytes += sizeof(char *) + strlen(fn->parameters[i]) + 1;
+      fprintf(dump->file, "object %p function %zu %s\n", (void *)fn, bytes,
+              fn->name);
+      for (size_t i = 0; i < fn->body_length; i++) {
+        dump_ast_node(dump, fn->body[i]);
+        dump_edge(dump, fn, fn->body[i], "strong");
+      }
+    }
+    return fn;
+  } else if (val.type == value_type_handle) {
+    handle *h = val.handle_value;
+    if (add_pointer(&dump->visited, h)) {
+      fprintf(dump->file, "object %p handle %zu\n", (void *)h, sizeof(handle));
+      if (h->weak_ref) {
+        value ref = {.type = value_type_weak_ref,
+                     .weak_ref_value = h->weak_ref};
+        dump_edge(dump, h, dump_value(dump, ref), "strong");
+      }
+    }
+    return h;
+  } else if (val.type == value_type_weak_ref) {
+    weak_ref *ref = val.weak_ref_value;
+    if (add_pointer(&dump->visited, ref)) {
+      fprintf(dump->file, "object %p weak-ref %zu\n", (void *)ref,
+              sizeof(weak_ref));
+      if (ref->target) {
+        value target = {.type = value_type_handle,
+                        .handle_value = ref->target};
+        dump_edge(dump, ref, dump_value(dump, target), "weak");
+      }
+    }
+    return ref;
+  } else if (val.type == value_type_bytevector) {
+    bytevector *bv = val.bytevector_value;
+    if (add_pointer(&dump->visited, bv)) {
+      fprintf(dump->file, "object %p bytevector %zu\n", (void *)bv,
+              sizeof(bytevector));
+      if (add_pointer(&dump->visited, bv->storage))
+        fprintf(dump->file, "object %p byte-storage %zu\n",
+                (void *)bv->storage,
+                sizeof(byte_storage) + bv->storage->length);
+      dump_edge(dump, bv, bv->storage, "strong");
+    }
+    return bv;
+  } else if (val.type == value_type_sketch) {
+    sketch *s = val.sketch_value;
+    if (add_pointer(&dump->visited, s))
+      fprintf(dump->file, "object %p sketch %zu\n", (void *)s,
+              sizeof(sketch) + s->cell_bytes);
+    return s;
+  } else if (val.type == value_type_matcher) {
+    matcher *m = val.matcher_value;
+    if (add_pointer(&dump->visited, m))
+      fprintf(dump->file, "object %p matcher %zu\n", (void *)m,
+              sizeof(matcher) +
+                  sizeof(int32_t) * m->state_count * (m->class_count + 2));
+    return m;
+  } else if (val.type == value_type_vector) {
+    vector *v = val.vector_value;
+    if (add_pointer(&dump->visited, v)) {
+      fprintf(dump->file, "object %p vector %zu\n", (void *)v,
+              sizeof(vector) + sizeof(value) * v->length);
+      for (size_t i = 0; i < v->length; i++) {
+        const void *item = dump_value(dump, v->items[i]);
+        if (item)
+          dump_edge(dump, v, item, "strong");
+      }
+    }
+    return v;
+  }
+  return NULL;
+}
+
+void dump_root(heap_dump *dump, const char *name, value val) {
+  const void *id = dump_value(dump, val);
+  if (id)
+    fprintf(dump->file, "root %p %s\n", id, name);
+}
+
+void dump_global_table(heap_dump *dump, const global_table *table) {
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->entries[i].name)
+      dump_root(dump, table->entries[i].name, table->entries[i].val);
   }
+}
+
+// Writes every object reachable from the context's globals, including its
+// preludes', and from its retired values. The format is line based:
+//
+//   object <id> <kind> <bytes> [name]
+//   edge <from id> <to id> strong|weak
+//   root <id> <global name>
+//
+// An object is always listed before the edges that leave it. Weak edges
+// don't keep their target alive and should be ignored when computing
+// dominators and retained sizes.
+result write_heap_dump(context *ctx, const char *path) {
+  heap_dump dump = {fopen(path, "w"), {NULL, 0, 0}};
+  if (!dump.file)
+    return create_error_result("Cannot write heap dump");
+
+  for (const context *scope = ctx; scope; scope = scope->prelude) {
+    dump_global_table(&dump, &scope->globals);
+    if (scope->staged_globals)
+      dump_global_table(&dump, scope->staged_globals);
+  }
+  for (size_t i = 0; i < ctx->retired.length; i++) {
+    dump_root(&dump, "<retired>", ctx->retired.values[i]);
+  }
+
+  size_t objects = dump.visited.length;
+  free(dump.visited.slots);
+  if (fclose(dump.file) != 0)
+    return create_error_result("Cannot write heap dump");
+  return create_success_result(create_int_value((int)objects));
+}
 
-  print_value(eval_result.result_value);
-  printf("\n");
+// Takes ownership of `val`.
+void define_global(context *ctx, const char *name, value val) {
+  ctx->definition_epoch++;
+  value replaced;
+  if (set_global(ctx->staged_globals ? ctx->staged_globals : &ctx->globals,
+                 name, val, &replaced))
+    retire_value(&ctx->retired, replaced);
+}
 
-  free_result(eval_result);
-  free_parse_result(parse_result);
+result eval_ast_node(context *ctx, environment *env, ast_node *node);
+result load_yalisp_file(context *ctx, const char *path);
+void warm_up_function(const context *ctx, function *fn);
+
+// Looks through the context's staged definitions and globals, and then
+// through its preludes' the same way: a child context's parent may be in the
+// middle of loading a file. The value is borrowed.
+value *find_global(const context *ctx, const char *name) {
+  value *val = NULL;
+  for (const context *scope = ctx; val == NULL && scope != NULL;
+       scope = scope->prelude) {
+    if (scope->staged_globals != NULL)
+      val = lookup_global(scope->staged_globals, name);
+    if (val == NULL)
+      val = lookup_global(&scope->globals, name);
+  }
+  return val;
+}
+
+result lookup_symbol(context *ctx, environment *env, const char *name) {
+  if (env != NULL) {
+    for (size_t i = 0; i < env->length; i++) {
+      if (strcmp(env->names[i], name) == 0)
+        return create_success_result(copy_value(env->values[i]));
+    }
+  }
+
+  value *val = find_global(ctx, name);
+  if (val == NULL)
+    return create_error_result("Undefined symbol");
+
+  return create_success_result(copy_value(*val));
+}
+
+// (define name expr) or (define (name params...) body...)
+result eval_define(context *ctx, environment *env, ast_node *node) {
+  if (ctx->is_frozen)
+    return create_error_result("Cannot define in a frozen context");
+
+  if (node->list.length < 3)
+    return create_error_result("define expects a name and a value");
+
+  ast_node *target = node->list.items[1];
+  if (target->type == node_type_symbol) {
+    if (node->list.length != 3)
+      return create_error_result("define expects a name and a value");
+
+    result value_result = eval_ast_node(ctx, env, node->list.items[2]);
+    if (value_result.is_error)
+      return value_result;
+
+    define_global(ctx, target->symbol_value,
+                  copy_value(value_result.result_value));
+    return value_result;
+  }
+
+  if (target->type != node_type_list || target->list.length == 0)
+    return create_error_result("define expects a name or a signature");
+
+  for (size_t i = 0; i < target->list.length; i++) {
+    if (target->list.items[i]->type != node_type_symbol)
+      return create_error_result("Function signature must contain symbols");
+  }
+
+  size_t parameter_count = target->list.length - 1;
+  char **parameters = malloc(sizeof(char *) * parameter_count);
+  for (size_t i = 0; i < parameter_count; i++) {
+    parameters[i] = strdup(target->list.items[i + 1]->symbol_value);
+  }
+
+  const char *name = target->list.items[0]->symbol_value;
+  function *fn = create_function(name, parameters, parameter_count,
+                                 node->list.items + 2, node->list.length - 2);
+  warm_up_function(ctx, fn);
+  value fn_value = create_function_value(fn);
+  define_global(ctx, name, copy_value(fn_value));
+  return create_success_result(fn_value);
+}
+
+// Serves the pending interrupt requests. Returns an error message when the
+// evaluation has to stop.
+const char *serve_interrupts(context *ctx) {
+  int requests = atomic_exchange_explicit(&ctx->interrupts, 0,
+                                          memory_order_acquire);
+  if ((requests & interrupt_sample) && ctx->sampler)
+    ctx->sampler(ctx->call_stack, ctx->sampler_data);
+  if (requests & interrupt_reclaim) {
+    reclaim_retired_values(ctx);
+    run_finalizers(&ctx->finalizers);
+  }
+  if (requests & interrupt_cancel)
+    return "Evaluation was interrupted";
+  return NULL;
+}
+
+// Checked on every call. Costs a relaxed load per context up to the first
+// frozen one unless an interrupt is pending or the evaluation is sandboxed.
+// A cancel sent to the parent of a child context stops the child too, but
+// stays pending for the parent to serve once its children are done.
+const char *poll_safepoint(context *ctx) {
+  if (atomic_load_explicit(&ctx->interrupts, memory_order_relaxed)) {
+    const char *error = serve_interrupts(ctx);
+    if (error)
+      return error;
+  }
+  for (const context *parent = ctx->prelude; parent && !parent->is_frozen;
+       parent = parent->prelude) {
+    if (atomic_load_explicit(&parent->interrupts, memory_order_relaxed) &
+        interrupt_cancel)
+      return "Evaluation was interrupted";
+  }
+  return ctx->sandbox ? check_sandbox(ctx->sandbox, 1) : NULL;
+}
+
+function *find_function_copy(const context *ctx, const function *original) {
+  if (ctx->function_copy_capacity == 0)
+    return NULL;
+
+  size_t mask = ctx->function_copy_capacity - 1;
+  size_t slot = hash_bytes(&original, sizeof(original)) & mask;
+  while (ctx->function_copies[slot].original != NULL) {
+    if (ctx->function_copies[slot].original == original)
+      return ctx->function_copies[slot].copy;
+    slot = (slot + 1) & mask;
+  }
+  return NULL;
+}
+
+void add_function_copy(context *ctx, const function *original,
+                       function *copy) {
+  if ((ctx->function_copy_count + 1) * 2 > ctx->function_copy_capacity) {
+    function_copy *old = ctx->function_copies;
+    size_t old_capacity = ctx->function_copy_capacity;
+    ctx->function_copy_capacity = old_capacity ? old_capacity * 2 : 16;
+    ctx->function_copies =
+        calloc(ctx->function_copy_capacity, sizeof(function_copy));
+    ctx->function_copy_count = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old[i].original)
+        add_function_copy(ctx, old[i].original, old[i].copy);
+    }
+    free(old);
+  }
+
+  size_t mask = ctx->function_copy_capacity - 1;
+  size_t slot = hash_bytes(&original, sizeof(original)) & mask;
+  while (ctx->function_copies[slot].original != NULL)
+    slot = (slot + 1) & mask;
+  ctx->function_copies[slot].original = original;
+  ctx->function_copies[slot].copy = copy;
+  ctx->function_copy_count++;
+}
+
+// Returns the function whose profile a call of `fn` counts towards. For an
+// immortal function that's a copy owned by the context, made on its first
+// call and starting out with the original's profile, so a worker tiers up
+// the prelude functions it calls on its own and can write their profiles.
+// Children use the copies their parents already made.
+function *profiled_function(context *ctx, function *fn) {
+  if (!fn->is_immortal || ctx->is_frozen)
+    return fn;
+
+  for (const context *scope = ctx; scope && !scope->is_frozen;
+       scope = scope->prelude) {
+    function *copy = find_function_copy(scope, fn);
+    if (copy)
+      return copy;
+  }
+
+  char **parameters = malloc(sizeof(char *) * (fn->parameter_count + 1));
+  for (size_t i = 0; i < fn->parameter_count; i++) {
+    parameters[i] = strdup(fn->parameters[i]);
+  }
+  function *copy = create_function(fn->name, parameters, fn->parameter_count,
+                                   fn->body, fn->body_length);
+  atomic_store(&copy->call_count, atomic_load(&fn->call_count));
+  atomic_store(&copy->saw_non_int_argument,
+               atomic_load(&fn->saw_non_int_argument));
+  add_function_copy(ctx, fn, copy);
+  return copy;
+}
+
+struct function_code *profile_call(function *fn, const value *arguments);
+result run_function_code(context *ctx, environment *env,
+                         struct function_code *code);
+
+// Evaluates the body of `fn` with its parameters bound to `arguments`, which
+// stay owned by the caller. Sandboxed code is always interpreted, since fuel
+// is counted per evaluated node.
+result apply_function(context *ctx, function *fn, value *arguments) {
+  call_frame call = {fn, ctx->call_stack};
+  ctx->call_stack = &call;
+
+  const char *error = poll_safepoint(ctx);
+  result res = error ? create_error_result(error)
+                     : create_success_result(create_int_value(0));
+
+  environment frame = {fn->parameters, arguments, fn->parameter_count};
+  struct function_code *code = NULL;
+  if (!res.is_error && !ctx->sandbox)
+    code = profile_call(profiled_function(ctx, fn), arguments);
+  if (code) {
+    free_result(res);
+    res = run_function_code(ctx, &frame, code);
+  } else {
+    for (size_t i = 0; i < fn->body_length && !res.is_error; i++) {
+      free_result(res);
+      res = eval_ast_node(ctx, &frame, fn->body[i]);
+    }
+  }
+  ctx->call_stack = call.caller;
+  return res;
+}
+
+result call_function(context *ctx, environment *env, function *fn,
+                     ast_node *node) {
+  if (node->list.length - 1 != fn->parameter_count)
+    return create_error_result("Wrong number of arguments");
+
+  value *arguments =
+      heap_allocate(heap_kind_frame, sizeof(value) * fn->parameter_count);
+  for (size_t i = 0; i < fn->parameter_count; i++) {
+    result arg_result = eval_ast_node(ctx, env, node->list.items[i + 1]);
+    if (arg_result.is_error) {
+      for (size_t j = 0; j < i; j++) {
+        free_value(arguments[j]);
+      }
+      heap_free(heap_kind_frame, arguments,
+                sizeof(value) * fn->parameter_count);
+      return arg_result;
+    }
+    arguments[i] = arg_result.result_value;
+  }
+
+  result res = apply_function(ctx, fn, arguments);
+  for (size_t i = 0; i < fn->parameter_count; i++) {
+    free_value(arguments[i]);
+  }
+  heap_free(heap_kind_frame, arguments, sizeof(value) * fn->parameter_count);
+  return res;
+}
+
+// Evaluates `count` argument expressions of a builtin call into `args`. On
+// error the arguments evaluated so far are freed again.
+result eval_arguments(context *ctx, environment *env, ast_node **items,
+                      value *args, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    result arg_result = eval_ast_node(ctx, env, items[i]);
+    if (arg_result.is_error) {
+      for (size_t j = 0; j < i; j++) {
+        free_value(args[j]);
+      }
+      return arg_result;
+    }
+    args[i] = arg_result.result_value;
+  }
+  return create_success_result(create_int_value(0));
+}
+
+typedef struct byte_reader {
+  const char *name;
+  size_t width;
+  int is_signed;
+  int is_big_endian;
+} byte_reader;
+
+static const byte_reader byte_readers[] = {
+    {"bytes-u8", 1, 0, 0},     {"bytes-s8", 1, 1, 0},
+    {"bytes-u16-le", 2, 0, 0}, {"bytes-u16-be", 2, 0, 1},
+    {"bytes-s16-le", 2, 1, 0}, {"bytes-s16-be", 2, 1, 1},
+    {"bytes-u32-le", 4, 0, 0}, {"bytes-u32-be", 4, 0, 1},
+    {"bytes-s32-le", 4, 1, 0}, {"bytes-s32-be", 4, 1, 1},
+    {"bytes-u64-le", 8, 0, 0}, {"bytes-u64-be", 8, 0, 1},
+    {"bytes-s64-le", 8, 1, 0}, {"bytes-s64-be", 8, 1, 1}};
+
+const byte_reader *find_byte_reader(const char *name) {
+  for (size_t i = 0; i < sizeof(byte_readers) / sizeof(byte_reader); i++) {
+    if (strcmp(byte_readers[i].name, name) == 0)
+      return &byte_readers[i];
+  }
+  return NULL;
+}
+
+// Loads an integer straight from the bytes. The fixed size copies compile to
+// single, possibly unaligned, loads.
+uint64_t load_bytes(const unsigned char *data, size_t width,
+                    int is_big_endian) {
+  int swap = is_big_endian != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+  if (width == 2) {
+    uint16_t bits;
+    memcpy(&bits, data, sizeof(bits));
+    return swap ? __builtin_bswap16(bits) : bits;
+  } else if (width == 4) {
+    uint32_t bits;
+    memcpy(&bits, data, sizeof(bits));
+    return swap ? __builtin_bswap32(bits) : bits;
+  } else if (width == 8) {
+    uint64_t bits;
+    memcpy(&bits, data, sizeof(bits));
+    return swap ? __builtin_bswap64(bits) : bits;
+  }
+  return data[0];
+}
+
+// Decodes the unsigned LEB128 varint at the start of `data`. Returns its size
+// in bytes, or 0 if it's cut off or longer than a 64-bit varint can be.
+size_t decode_varint(const unsigned char *data, size_t length,
+                     uint64_t *decoded) {
+  *decoded = 0;
+  for (size_t i = 0; i < length && i < 10; i++) {
+    *decoded |= (uint64_t)(data[i] & 0x7f) << (7 * i);
+    if (!(data[i] & 0x80))
+      return i + 1;
+  }
+  return 0;
+}
+
+void unmap_bytes(void *data, size_t length, void *host_data) {
+  (void)host_data;
+  munmap(data, length);
+}
+
+// Maps the file read-only, so its bytes are paged in as they're read. An
+// empty file can't be mapped and gives NULL. Returns an error message on
+// failure.
+const char *map_file(const char *path, void **data, size_t *length) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return "Cannot open file";
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return "Cannot read file";
+  }
+
+  *length = (size_t)st.st_size;
+  *data = NULL;
+  if (*length > 0)
+    *data = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return *data == MAP_FAILED ? "Cannot map file" : NULL;
+}
+
+result map_file_bytes(const char *path) {
+  void *data;
+  size_t length;
+  const char *error = map_file(path, &data, &length);
+  if (error)
+    return create_error_result(error);
+  if (!data)
+    return create_success_result(create_bytevector_value("", 0));
+  return create_success_result(
+      create_host_bytevector_value(data, length, unmap_bytes, NULL));
+}
+
+int is_bytevector_builtin(const char *name) {
+  return strcmp(name, "file-bytes") == 0 ||
+         strcmp(name, "string-bytes") == 0 ||
+         strcmp(name, "bytes-length") == 0 ||
+         strcmp(name, "bytes-slice") == 0 ||
+         strcmp(name, "bytes-varint") == 0 ||
+         strcmp(name, "bytes-varint-size") == 0 || find_byte_reader(name);
+}
+
+result eval_bytevector_operation(const char *name, value *args) {
+  if (strcmp(name, "file-bytes") == 0 || strcmp(name, "string-bytes") == 0) {
+    if (args[0].type != value_type_string)
+      return create_error_result("Expected a string argument");
+    if (name[0] == 'f')
+      return map_file_bytes(args[0].string_value);
+    return create_success_result(create_bytevector_value(
+        args[0].string_value, strlen(args[0].string_value)));
+  }
+
+  if (args[0].type != value_type_bytevector)
+    return create_error_result("Expected a bytevector argument");
+  bytevector *bv = args[0].bytevector_value;
+  if (strcmp(name, "bytes-length") == 0) {
+    if (bv->length > INT_MAX)
+      return create_error_result("Bytevector length does not fit an integer");
+    return create_success_result(create_int_value((int)bv->length));
+  }
+
+  if (args[1].type != value_type_int || args[1].int_value < 0 ||
+      (size_t)args[1].int_value > bv->length)
+    return create_error_result("Offset out of range");
+  size_t offset = (size_t)args[1].int_value;
+
+  if (strcmp(name, "bytes-slice") == 0) {
+    if (args[2].type != value_type_int || args[2].int_value < 0 ||
+        (size_t)args[2].int_value < offset ||
+        (size_t)args[2].int_value > bv->length)
+      return create_error_result("Offset out of range");
+    return create_success_result(
+        slice_bytevector(bv, offset, (size_t)args[2].int_value));
+  }
+
+  uint64_t bits;
+  int is_signed = 0;
+  const byte_reader *reader = find_byte_reader(name);
+  if (reader) {
+    if (bv->length - offset < reader->width)
+      return create_error_result("Offset out of range");
+    bits = load_bytes(bv->data + offset, reader->width, reader->is_big_endian);
+    is_signed = reader->is_signed;
+    if (is_signed && reader->width < 8) {
+      uint64_t sign = 1ULL << (reader->width * 8 - 1);
+      bits = (bits ^ sign) - sign;
+    }
+  } else {
+    size_t size = decode_varint(bv->data + offset, bv->length - offset, &bits);
+    if (size == 0)
+      return create_error_result("Malformed varint");
+    if (strcmp(name, "bytes-varint-size") == 0)
+      return create_success_result(create_int_value((int)size));
+  }
+
+  if (is_signed ? (int64_t)bits < INT_MIN || (int64_t)bits > INT_MAX
+                : bits > INT_MAX)
+    return create_error_result("Value read does not fit an integer");
+  return create_success_result(create_int_value((int)(int64_t)bits));
+}
+
+// Bytevector builtins. The reads take the bytevector and a byte offset and
+// never copy its bytes.
+result eval_bytevector_builtin(context *ctx, environment *env, ast_node *node) {
+  const char *name = node->list.items[0]->symbol_value;
+  size_t count = 2;
+  if (strcmp(name, "file-bytes") == 0 || strcmp(name, "string-bytes") == 0 ||
+      strcmp(name, "bytes-length") == 0) {
+    count = 1;
+  } else if (strcmp(name, "bytes-slice") == 0) {
+    count = 3;
+  }
+  if (node->list.length - 1 != count)
+    return create_error_result("Wrong number of arguments");
+
+  value args[3];
+  result args_result =
+      eval_arguments(ctx, env, node->list.items + 1, args, count);
+  if (args_result.is_error)
+    return args_result;
+
+  result res = eval_bytevector_operation(name, args);
+  for (size_t i = 0; i < count; i++) {
+    free_value(args[i]);
+  }
+  return res;
+}
+
+// Sketch builtins. Items are integers or strings and go in by their hash.
+
+uint64_t hash_item(value item) {
+  if (item.type == value_type_int)
+    return hash_key(item.int_value);
+  return finalize_hash(hash_string(item.string_value));
+}
+
+// Cells of the `i`th of several independent hashes of an item are derived
+// from two halves of one hash.
+size_t sketch_cell(uint64_t hash, size_t i, size_t width) {
+  uint64_t step = (hash >> 32) | 1;
+  return (size_t)((hash + i * step) & (width - 1));
+}
+
+void add_to_sketch(sketch *s, uint64_t hash) {
+  if (s->kind == sketch_kind_hyperloglog) {
+    // The top bits pick the register, which keeps the highest position of
+    // the first set bit seen in the rest.
+    size_t precision = (size_t)__builtin_ctzll(s->width);
+    unsigned char *registers = s->cells;
+    unsigned char rank = (unsigned char)(
+        __builtin_clzll((hash << precision) | (1ULL << (precision - 1))) + 1);
+    unsigned char *reg = &registers[hash >> (64 - precision)];
+    unsigned char seen = __atomic_load_n(reg, __ATOMIC_RELAXED);
+    while (rank > seen &&
+           !__atomic_compare_exchange_n(reg, &seen, rank, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+      ;
+  } else if (s->kind == sketch_kind_count_min) {
+    uint32_t *counters = s->cells;
+    for (size_t i = 0; i < s->depth; i++) {
+      size_t cell = i * s->width + sketch_cell(hash, i, s->width);
+      __atomic_fetch_add(&counters[cell], 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    uint64_t *words = s->cells;
+    for (size_t i = 0; i < s->hash_count; i++) {
+      size_t bit = sketch_cell(hash, i, s->width);
+      __atomic_fetch_or(&words[bit / 64], 1ULL << (bit % 64),
+                        __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Natural logarithm without libm: x = m * 2^e with m in [1, 2), and
+// ln(m) = 2 atanh((m - 1) / (m + 1)), whose series converges quickly there.
+double natural_log(double x) {
+  int exponent = 0;
+  while (x >= 2) {
+    x /= 2;
+    exponent++;
+  }
+  while (x < 1) {
+    x *= 2;
+    exponent--;
+  }
+  double t = (x - 1) / (x + 1);
+  double term = t;
+  double sum = 0;
+  for (int i = 1; i < 40; i += 2) {
+    sum += term / i;
+    term *= t * t;
+  }
+  return 2 * sum + exponent * 0.6931471805599453;
+}
+
+uint64_t estimate_distinct(const sketch *s) {
+  const unsigned char *registers = s->cells;
+  double m = (double)s->width;
+  double inverse_sum = 0;
+  size_t zeros = 0;
+  for (size_t i = 0; i < s->width; i++) {
+    inverse_sum += 1.0 / (double)(1ULL << registers[i]);
+    zeros += registers[i] == 0;
+  }
+
+  double alpha = s->width == 16   ? 0.673
+                 : s->width == 32 ? 0.697
+                 : s->width == 64 ? 0.709
+                                  : 0.7213 / (1 + 1.079 / m);
+  double estimate = alpha * m * m / inverse_sum;
+  // Small cardinalities are counted more precisely from the empty registers.
+  if (estimate <= 2.5 * m && zeros > 0)
+    estimate = m * natural_log(m / (double)zeros);
+  return (uint64_t)(estimate + 0.5);
+}
+
+uint64_t estimate_frequency(const sketch *s, uint64_t hash) {
+  const uint32_t *counters = s->cells;
+  uint32_t estimate = UINT32_MAX;
+  for (size_t i = 0; i < s->depth; i++) {
+    uint32_t count = counters[i * s->width + sketch_cell(hash, i, s->width)];
+    if (count < estimate)
+      estimate = count;
+  }
+  return estimate;
+}
+
+int bloom_filter_contains(const sketch *s, uint64_t hash) {
+  const uint64_t *words = s->cells;
+  for (size_t i = 0; i < s->hash_count; i++) {
+    size_t bit = sketch_cell(hash, i, s->width);
+    if (!(words[bit / 64] & (1ULL << (bit % 64))))
+      return 0;
+  }
+  return 1;
+}
+
+int sketches_match(const sketch *a, const sketch *b) {
+  return a->kind == b->kind && a->width == b->width &&
+         a->depth == b->depth && a->hash_count == b->hash_count;
+}
+
+// Folds `source` into `target`, which then summarizes the items of both, so
+// sketches filled by separate threads or processes combine into one. The
+// sketches must match and `source` must not be added to meanwhile.
+void merge_sketch(sketch *target, const sketch *source) {
+  if (target->kind == sketch_kind_hyperloglog) {
+    unsigned char *to = target->cells;
+    const unsigned char *from = source->cells;
+    for (size_t i = 0; i < target->cell_bytes; i++)
+      to[i] = from[i] > to[i] ? from[i] : to[i];
+  } else if (target->kind == sketch_kind_count_min) {
+    uint32_t *to = target->cells;
+    const uint32_t *from = source->cells;
+    for (size_t i = 0; i < target->cell_bytes / sizeof(uint32_t); i++)
+      to[i] += from[i];
+  } else {
+    uint64_t *to = target->cells;
+    const uint64_t *from = source->cells;
+    for (size_t i = 0; i < target->cell_bytes / sizeof(uint64_t); i++)
+      to[i] |= from[i];
+  }
+}
+
+int is_sketch_builtin(const char *name) {
+  return strcmp(name, "make-hyperloglog") == 0 ||
+         strcmp(name, "make-count-min") == 0 ||
+         strcmp(name, "make-bloom-filter") == 0 ||
+         strcmp(name, "sketch-add") == 0 ||
+         strcmp(name, "sketch-merge") == 0 ||
+         strcmp(name, "sketch-count") == 0 ||
+         strcmp(name, "sketch-contains") == 0;
+}
+
+// Smallest power of two not below `n`, or 0 if `n` is out of [1, limit].
+size_t sketch_width(int n, size_t limit) {
+  if (n < 1 || (size_t)n > limit)
+    return 0;
+  size_t width = 1;
+  while (width < (size_t)n)
+    width *= 2;
+  return width;
+}
+
+// Creates a sketch unless its cells would take a sandboxed evaluation over
+// its memory limit.
+result create_sketch_result(const context *ctx, sketch_kind kind,
+                            size_t width, size_t depth, size_t hash_count) {
+  const char *error = reserve_sandbox_memory(
+      ctx->sandbox, sizeof(sketch) + sketch_cell_bytes(kind, width, depth));
+  if (error)
+    return create_error_result(error);
+  return create_success_result(
+      create_sketch_value(kind, width, depth, hash_count));
+}
+
+result eval_sketch_operation(const context *ctx, const char *name,
+                             value *args, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (args[i].type != value_type_int && strncmp(name, "make-", 5) == 0)
+      return create_error_result("Sketch sizes must be integers");
+  }
+
+  if (strcmp(name, "make-hyperloglog") == 0) {
+    // (make-hyperloglog precision): 2^precision registers, with a standard
+    // error of about 1.04 / sqrt(2^precision).
+    if (count != 1 || args[0].int_value < 4 || args[0].int_value > 18)
+      return create_error_result("make-hyperloglog expects a precision "
+                                 "between 4 and 18");
+    return create_sketch_result(ctx, sketch_kind_hyperloglog,
+                                (size_t)1 << args[0].int_value, 1, 0);
+  } else if (strcmp(name, "make-count-min") == 0) {
+    // (make-count-min width depth)
+    size_t width = count == 2 ? sketch_width(args[0].int_value, 1 << 24) : 0;
+    if (width == 0 || args[1].int_value < 1 || args[1].int_value > 16)
+      return create_error_result("make-count-min expects a width up to 2^24 "
+                                 "and a depth up to 16");
+    return create_sketch_result(ctx, sketch_kind_count_min, width,
+                                (size_t)args[1].int_value, 0);
+  } else if (strcmp(name, "make-bloom-filter") == 0) {
+    // (make-bloom-filter bits hashes)
+    size_t width = count == 2 ? sketch_width(args[0].int_value, 1 << 30) : 0;
+    if (width == 0 || args[1].int_value < 1 || args[1].int_value > 16)
+      return create_error_result("make-bloom-filter expects up to 2^30 bits "
+                                 "and up to 16 hashes");
+    if (width < 64)
+      width = 64;
+    return create_sketch_result(ctx, sketch_kind_bloom_filter, width, 1,
+                                (size_t)args[1].int_value);
+  }
+
+  if (count == 0 || args[0].type != value_type_sketch)
+    return create_error_result("Expected a sketch argument");
+  sketch *s = args[0].sketch_value;
+
+  if (strcmp(name, "sketch-merge") == 0) {
+    if (count != 2 || args[1].type != value_type_sketch ||
+        !sketches_match(s, args[1].sketch_value))
+      return create_error_result("sketch-merge expects two sketches of the "
+                                 "same kind and size");
+    result merged =
+        create_sketch_result(ctx, s->kind, s->width, s->depth, s->hash_count);
+    if (!merged.is_error) {
+      merge_sketch(merged.result_value.sketch_value, s);
+      merge_sketch(merged.result_value.sketch_value, args[1].sketch_value);
+    }
+    return merged;
+  }
+
+  if (strcmp(name, "sketch-count") == 0 && s->kind == sketch_kind_hyperloglog) {
+    if (count != 1)
+      return create_error_result("Wrong number of arguments");
+    uint64_t estimate = estimate_distinct(s);
+    return create_success_result(
+        create_int_value(estimate > INT_MAX ? INT_MAX : (int)estimate));
+  }
+
+  if (count != 2)
+    return create_error_result("Wrong number of arguments");
+  if (args[1].type != value_type_int && args[1].type != value_type_string)
+    return create_error_result("Sketch items must be integers or strings");
+  uint64_t hash = hash_item(args[1]);
+
+  if (strcmp(name, "sketch-add") == 0) {
+    if (s->is_immortal)
+      return create_error_result("Cannot add to a frozen sketch");
+    add_to_sketch(s, hash);
+    return create_success_result(copy_value(args[0]));
+  } else if (strcmp(name, "sketch-count") == 0 &&
+             s->kind == sketch_kind_count_min) {
+    uint64_t estimate = estimate_frequency(s, hash);
+    return create_success_result(
+        create_int_value(estimate > INT_MAX ? INT_MAX : (int)estimate));
+  } else if (strcmp(name, "sketch-contains") == 0 &&
+             s->kind == sketch_kind_bloom_filter) {
+    return create_success_result(
+        create_int_value(bloom_filter_contains(s, hash)));
+  }
+  return create_error_result("Operation does not apply to this sketch");
+}
+
+// (make-hyperloglog precision), (make-count-min width depth),
+// (make-bloom-filter bits hashes), (sketch-add s item), (sketch-merge a b),
+// (sketch-count hll), (sketch-count count-min item) and
+// (sketch-contains bloom item).
+result eval_sketch_builtin(context *ctx, environment *env, ast_node *node) {
+  size_t count = node->list.length - 1;
+  if (count > 2)
+    return create_error_result("Wrong number of arguments");
+
+  value args[2];
+  result args_result =
+      eval_arguments(ctx, env, node->list.items + 1, args, count);
+  if (args_result.is_error)
+    return args_result;
+
+  result res = eval_sketch_operation(ctx, node->list.items[0]->symbol_value,
+                                     args, count);
+  for (size_t i = 0; i < count; i++) {
+    free_value(args[i]);
+  }
+  return res;
+}
+
+// Builds a matcher for the non-empty `patterns`, numbered by their position.
+// A pattern given twice only matches as its first occurrence.
+value create_matcher_value(const char **patterns, const size_t *lengths,
+                           size_t pattern_count) {
+  matcher *m = heap_allocate(heap_kind_matcher, sizeof(matcher));
+  atomic_init(&m->refcount, 1);
+  m->is_immortal = 0;
+  m->pattern_count = pattern_count;
+  memset(m->byte_classes, 0, sizeof(m->byte_classes));
+  memset(m->first_bytes, 0, sizeof(m->first_bytes));
+
+  size_t total_length = 0;
+  m->class_count = 1;
+  m->only_first_byte = -1;
+  for (size_t i = 0; i < pattern_count; i++) {
+    const unsigned char *pattern = (const unsigned char *)patterns[i];
+    total_length += lengths[i];
+    m->only_first_byte = i == 0 || m->only_first_byte == pattern[0]
+                             ? pattern[0]
+                             : -2;
+    m->first_bytes[pattern[0]] = 1;
+    for (size_t j = 0; j < lengths[i]; j++) {
+      if (m->byte_classes[pattern[j]] == 0)
+        m->byte_classes[pattern[j]] = (uint16_t)m->class_count++;
+    }
+  }
+  if (m->only_first_byte < 0)
+    m->only_first_byte = -1;
+
+  // The trie has at most one state per pattern byte plus the root.
+  size_t capacity = total_length + 1;
+  size_t classes = m->class_count;
+  int32_t *transitions = malloc(sizeof(int32_t) * capacity * classes);
+  int32_t *outputs = malloc(sizeof(int32_t) * capacity);
+  memset(transitions, 0xff, sizeof(int32_t) * classes);
+  outputs[0] = -1;
+  size_t state_count = 1;
+  for (size_t i = 0; i < pattern_count; i++) {
+    const unsigned char *pattern = (const unsigned char *)patterns[i];
+    size_t state = 0;
+    for (size_t j = 0; j < lengths[i]; j++) {
+      int32_t *next = &transitions[state * classes +
+                                   m->byte_classes[pattern[j]]];
+      if (*next < 0) {
+        memset(&transitions[state_count * classes], 0xff,
+               sizeof(int32_t) * classes);
+        outputs[state_count] = -1;
+        *next = (int32_t)state_count++;
+      }
+      state = (size_t)*next;
+    }
+    if (outputs[state] < 0)
+      outputs[state] = (int32_t)i;
+  }
+
+  // Breadth first, every missing transition becomes the one of the state's
+  // failure state, which is the longest proper suffix that's also in the
+  // trie and was visited before.
+  m->state_count = state_count;
+  m->transitions =
+      heap_allocate(heap_kind_matcher, sizeof(int32_t) * state_count * classes);
+  m->outputs = heap_allocate(heap_kind_matcher, sizeof(int32_t) * state_count);
+  m->output_links =
+      heap_allocate(heap_kind_matcher, sizeof(int32_t) * state_count);
+  memcpy(m->transitions, transitions, sizeof(int32_t) * state_count * classes);
+  memcpy(m->outputs, outputs, sizeof(int32_t) * state_count);
+  free(transitions);
+  free(outputs);
+
+  int32_t *failures = malloc(sizeof(int32_t) * state_count);
+  int32_t *queue = malloc(sizeof(int32_t) * state_count);
+  size_t head = 0, tail = 0;
+  failures[0] = 0;
+  m->output_links[0] = -1;
+  for (size_t c = 0; c < classes; c++) {
+    int32_t *next = &m->transitions[c];
+    if (*next < 0) {
+      *next = 0;
+    } else {
+      failures[*next] = 0;
+      m->output_links[*next] = -1;
+      queue[tail++] = *next;
+    }
+  }
+  while (head < tail) {
+    size_t state = (size_t)queue[head++];
+    int32_t *row = &m->transitions[state * classes];
+    const int32_t *failure_row = &m->transitions[failures[state] * classes];
+    for (size_t c = 0; c < classes; c++) {
+      if (row[c] < 0) {
+        row[c] = failure_row[c];
+        continue;
+      }
+
+      int32_t child = row[c];
+      int32_t failure = failure_row[c];
+      failures[child] = failure;
+      m->output_links[child] =
+          m->outputs[failure] >= 0 ? failure : m->output_links[failure];
+      queue[tail++] = child;
+    }
+  }
+  free(queue);
+  free(failures);
+
+  value val;
+  val.type = value_type_matcher;
+  val.matcher_value = m;
+  return val;
+}
+
+// Calls `on_match` with the pattern and the offset right after it for every
+// occurrence in `text`, by increasing end offset, until it returns nonzero.
+// Returns the number of occurrences reported.
+size_t scan_matcher(const matcher *m, const char *text, size_t length,
+                    int (*on_match)(size_t pattern, size_t end, void *data),
+                    void *data) {
+  const unsigned char *bytes = (const unsigned char *)text;
+  size_t classes = m->class_count;
+  size_t matches = 0;
+  size_t state = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (state == 0) {
+      if (m->only_first_byte >= 0) {
+        const unsigned char *next =
+            memchr(bytes + i, m->only_first_byte, length - i);
+        if (!next)
+          break;
+        i = (size_t)(next - bytes);
+      } else {
+        while (i < length && !m->first_bytes[bytes[i]])
+          i++;
+        if (i == length)
+          break;
+      }
+    }
+
+    state = (size_t)m->transitions[state * classes + m->byte_classes[bytes[i]]];
+    int32_t output = m->outputs[state] >= 0 ? (int32_t)state
+                                            : m->output_links[state];
+    for (; output >= 0; output = m->output_links[output]) {
+      matches++;
+      if (on_match && on_match((size_t)m->outputs[output], i + 1, data))
+        return matches;
+    }
+  }
+  return matches;
+}
+
+int stop_at_first_match(size_t pattern, size_t end, void *data) {
+  (void)end;
+  *(size_t *)data = pattern;
+  return 1;
+}
+
+typedef struct match_list {
+  value *matches; // malloc'd, moved into a vector once the scan is done
+  size_t count;
+  size_t capacity;
+} match_list;
+
+// Appends the match as a #(pattern end) vector.
+int collect_match(size_t pattern, size_t end, void *data) {
+  match_list *list = data;
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 16;
+    list->matches = realloc(list->matches, sizeof(value) * list->capacity);
+  }
+
+  value *pair = allocate_vector_items(2);
+  pair[0] = create_int_value((int)pattern);
+  pair[1] = create_int_value(end > INT_MAX ? INT_MAX : (int)end);
+  list->matches[list->count++] = create_vector_value(pair, 2);
+  return 0;
+}
+
+// One pattern per line; empty lines are skipped.
+result load_matcher(const char *path) {
+  void *data;
+  size_t length;
+  const char *error = map_file(path, &data, &length);
+  if (error)
+    return create_error_result(error);
+
+  const char **patterns = NULL;
+  size_t *lengths = NULL;
+  size_t count = 0;
+  const char *text = data;
+  const char *line = text;
+  while (line < text + length) {
+    const char *newline = memchr(line, '\n', text + length - line);
+    const char *end = newline ? newline : text + length;
+    if (end > line) {
+      patterns = realloc(patterns, sizeof(char *) * (count + 1));
+      lengths = realloc(lengths, sizeof(size_t) * (count + 1));
+      patterns[count] = line;
+      lengths[count++] = (size_t)(end - line);
+    }
+    line = end + 1;
+  }
+
+  value val = create_matcher_value(patterns, lengths, count);
+  free(patterns);
+  free(lengths);
+  if (data)
+    munmap(data, length);
+  return create_success_result(val);
+}
+
+int is_matcher_builtin(const char *name) {
+  return strcmp(name, "make-matcher") == 0 ||
+         strcmp(name, "load-matcher") == 0 ||
+         strcmp(name, "matcher-scan") == 0 ||
+         strcmp(name, "matcher-find") == 0;
+}
+
+result eval_matcher_operation(const char *name, value *args, size_t count) {
+  int is_scan = strcmp(name, "matcher-scan") == 0 ||
+                strcmp(name, "matcher-find") == 0;
+  // A single vector holds the patterns instead of the arguments.
+  if (!is_scan && count == 1 && args[0].type == value_type_vector) {
+    const vector *patterns = args[0].vector_value;
+    args = patterns->items;
+    count = patterns->length;
+  }
+  for (size_t i = is_scan ? 1 : 0; i < count; i++) {
+    if (args[i].type != value_type_string)
+      return create_error_result("Expected a string argument");
+  }
+
+  if (strcmp(name, "make-matcher") == 0) {
+    const char **patterns = malloc(sizeof(char *) * (count ? count : 1));
+    size_t *lengths = malloc(sizeof(size_t) * (count ? count : 1));
+    for (size_t i = 0; i < count; i++) {
+      patterns[i] = args[i].string_value;
+      lengths[i] = strlen(patterns[i]);
+      if (lengths[i] == 0) {
+        free(patterns);
+        free(lengths);
+        return create_error_result("Patterns must not be empty");
+      }
+    }
+    value val = create_matcher_value(patterns, lengths, count);
+    free(patterns);
+    free(lengths);
+    return create_success_result(val);
+  } else if (strcmp(name, "load-matcher") == 0) {
+    if (count != 1)
+      return create_error_result("load-matcher expects a file path");
+    return load_matcher(args[0].string_value);
+  }
+
+  if (count != 2 || args[0].type != value_type_matcher)
+    return create_error_result("Expected a matcher and a text");
+  const matcher *m = args[0].matcher_value;
+  const char *text = args[1].string_value;
+  if (strcmp(name, "matcher-scan") == 0) {
+    match_list list = {NULL, 0, 0};
+    scan_matcher(m, text, strlen(text), collect_match, &list);
+    value *matches = NULL;
+    if (list.count) {
+      matches = allocate_vector_items(list.count);
+      memcpy(matches, list.matches, sizeof(value) * list.count);
+    }
+    free(list.matches);
+    return create_success_result(create_vector_value(matches, list.count));
+  }
+
+  size_t pattern = SIZE_MAX;
+  scan_matcher(m, text, strlen(text), stop_at_first_match, &pattern);
+  return create_success_result(
+      create_int_value(pattern == SIZE_MAX ? -1 : (int)pattern));
+}
+
+// (make-matcher pattern...) or (make-matcher patterns), (load-matcher file),
+// (matcher-scan m text) for a #(pattern end) vector per occurrence of any
+// pattern and (matcher-find m text) for the index of the pattern that ends
+// first, or -1.
+result eval_matcher_builtin(context *ctx, environment *env, ast_node *node) {
+  size_t count = node->list.length - 1;
+  value *args = heap_allocate(heap_kind_frame, sizeof(value) * count);
+  result res = eval_arguments(ctx, env, node->list.items + 1, args, count);
+  if (!res.is_error) {
+    res = eval_matcher_operation(node->list.items[0]->symbol_value, args,
+                                 count);
+    for (size_t i = 0; i < count; i++) {
+      free_value(args[i]);
+    }
+  }
+  heap_free(heap_kind_frame, args, sizeof(value) * count);
+  return res;
+}
+
+// Part of a mapped file whose lines one worker passes to `fn`. Integer
+// results of `fn` are summed and string results concatenated in line order.
+// Sums are kept in 64 bits, so only the total has to fit an int.
+typedef struct line_chunk {
+  context *ctx;
+  function *fn;
+  const char *begin;
+  const char *end;
+  int keeps_results;
+  size_t line_count;
+  value_type result_type; // of the first result
+  int64_t sum;
+  char *text;
+  size_t text_length;
+  size_t text_capacity;
+  char *error_message; // of the first failed call, which stops the chunk
+} line_chunk;
+
+void append_chunk_text(line_chunk *chunk, const char *string) {
+  size_t length = strlen(string);
+  if (chunk->text_length + length + 1 > chunk->text_capacity) {
+    chunk->text_capacity = (chunk->text_length + length + 1) * 2;
+    chunk->text = realloc(chunk->text, chunk->text_capacity);
+  }
+  memcpy(chunk->text + chunk->text_length, string, length + 1);
+  chunk->text_length += length;
+}
+
+// Returns an error message when `fn`'s result can't be merged.
+const char *merge_line_result(line_chunk *chunk, value val) {
+  if (chunk->line_count == 1)
+    chunk->result_type = val.type;
+  if (val.type != chunk->result_type ||
+      (val.type != value_type_int && val.type != value_type_string))
+    return "Lines must all map to integers or all to strings";
+
+  if (val.type == value_type_string) {
+    append_chunk_text(chunk, val.string_value);
+  } else if (__builtin_add_overflow(chunk->sum, val.int_value, &chunk->sum)) {
+    return "Sum of the lines doesn't fit an integer";
+  }
+  return NULL;
+}
+
+// Merges the results of a chunk into `merged`, which starts out empty.
+const char *merge_line_chunk(line_chunk *merged, const line_chunk *chunk) {
+  if (merged->line_count == 0)
+    merged->result_type = chunk->result_type;
+  merged->line_count += chunk->line_count;
+  if (chunk->result_type != merged->result_type)
+    return "Lines must all map to integers or all to strings";
+
+  if (chunk->text)
+    append_chunk_text(merged, chunk->text);
+  if (__builtin_add_overflow(merged->sum, chunk->sum, &merged->sum))
+    return "Sum of the lines doesn't fit an integer";
+  return NULL;
+}
+
+void map_line_chunk(line_chunk *chunk) {
+  const char *line = chunk->begin;
+  while (line < chunk->end && !chunk->error_message) {
+    const char *newline = memchr(line, '\n', chunk->end - line);
+    const char *line_end = newline ? newline : chunk->end;
+
+    value argument = {.type = value_type_string,
+                      .string_value = heap_strndup(line, line_end - line)};
+    chunk->line_count++;
+    result res = apply_function(chunk->ctx, chunk->fn, &argument);
+    free_value(argument);
+    if (res.is_error) {
+      chunk->error_message = strdup(res.error_message);
+    } else if (chunk->keeps_results) {
+      const char *error = merge_line_result(chunk, res.result_value);
+      if (error)
+        chunk->error_message = strdup(error);
+    }
+    free_result(res);
+    line = line_end + 1;
+  }
+}
+
+void *map_line_chunk_thread(void *data) {
+  line_chunk *chunk = data;
+  map_line_chunk(chunk);
+  free_context(chunk->ctx);
+  return NULL;
+}
+
+// Worker chunks are at least this big, so small files stay on one thread.
+#define LINE_CHUNK_MIN_BYTES (256 * 1024)
+
+// Calls `fn` on every line of the file. With `keeps_results` the results are
+// merged, otherwise the number of lines is returned. More than one thread
+// splits the file at line boundaries and evaluates every part in its own
+// child context of `ctx`.
+result map_file_lines(context *ctx, const char *path, function *fn,
+                      int keeps_results, size_t thread_count) {
+  if (fn->parameter_count != 1)
+    return create_error_result("Line function must take one argument");
+
+  void *data;
+  size_t length;
+  const char *error = map_file(path, &data, &length);
+  if (error)
+    return create_error_result(error);
+
+  if (thread_count > length / LINE_CHUNK_MIN_BYTES)
+    thread_count = length / LINE_CHUNK_MIN_BYTES;
+  if (thread_count == 0)
+    thread_count = 1;
+
+  const char *text = data;
+  line_chunk *chunks = calloc(thread_count, sizeof(line_chunk));
+  pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+  const char *begin = text;
+  for (size_t i = 0; i < thread_count; i++) {
+    // Every chunk but the last ends right after a newline.
+    const char *end = text + length;
+    if (i + 1 < thread_count) {
+      const char *split = text + length * (i + 1) / thread_count;
+      if (split < begin)
+        split = begin;
+      const char *newline = memchr(split, '\n', text + length - split);
+      if (newline)
+        end = newline + 1;
+    }
+
+    line_chunk *chunk = &chunks[i];
+    chunk->fn = fn;
+    chunk->begin = begin;
+    chunk->end = end;
+    chunk->keeps_results = keeps_results;
+    begin = end;
+    if (thread_count == 1) {
+      chunk->ctx = ctx;
+      map_line_chunk(chunk);
+      threads[i] = pthread_self();
+      continue;
+    }
+
+    chunk->ctx = create_child_context(ctx);
+    if (pthread_create(&threads[i], NULL, map_line_chunk_thread, chunk) !=
+        0) {
+      map_line_chunk_thread(chunk);
+      threads[i] = pthread_self();
+    }
+  }
+
+  for (size_t i = 0; i < thread_count; i++) {
+    if (!pthread_equal(threads[i], pthread_self()))
+      pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  if (data)
+    munmap(data, length);
+
+  // The children stopped at a cancel sent to `ctx` but left it pending.
+  const char *interrupted = thread_count > 1 ? serve_interrupts(ctx) : NULL;
+  result res = interrupted ? create_error_result(interrupted)
+                           : create_success_result(create_int_value(0));
+  line_chunk merged = {.keeps_results = 1};
+  size_t line_count = 0;
+  for (size_t i = 0; i < thread_count && !res.is_error; i++) {
+    line_chunk *chunk = &chunks[i];
+    line_count += chunk->line_count;
+    if (chunk->error_message) {
+      res = create_error_result(chunk->error_message);
+    } else if (keeps_results && chunk->line_count > 0) {
+      error = merge_line_chunk(&merged, chunk);
+      if (error)
+        res = create_error_result(error);
+    }
+  }
+  for (size_t i = 0; i < thread_count; i++) {
+    free(chunks[i].text);
+    free(chunks[i].error_message);
+  }
+  free(chunks);
+
+  if (res.is_error) {
+    free(merged.text);
+    return res;
+  } else if (!keeps_results) {
+    return create_success_result(create_int_value((int)line_count));
+  } else if (merged.line_count > 0 && merged.result_type == value_type_string) {
+    res = create_success_result(
+        create_string_value(merged.text ? merged.text : ""));
+    free(merged.text);
+    return res;
+  } else if (merged.sum < INT_MIN || merged.sum > INT_MAX) {
+    return create_error_result("Sum of the lines doesn't fit an integer");
+  }
+  return create_success_result(create_int_value((int)merged.sum));
+}
+
+// Default number of threads for builtins that split their work.
+size_t online_cpu_count() {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? (size_t)cores : 1;
+}
+
+// (for-each-line file fn) and (map-lines file fn [:threads n]).
+result eval_line_builtin(context *ctx, environment *env, ast_node *node) {
+  int is_map = strcmp(node->list.items[0]->symbol_value, "map-lines") == 0;
+  size_t arg_count = 2;
+  if (is_map && node->list.length == 5 &&
+      node->list.items[3]->type == node_type_symbol &&
+      strcmp(node->list.items[3]->symbol_value, ":threads") == 0) {
+    arg_count = 3;
+  } else if (node->list.length != 3) {
+    return create_error_result(is_map
+                                   ? "map-lines expects a file, a function "
+                                     "and optionally :threads n"
+                                   : "for-each-line expects a file and a "
+                                     "function");
+  }
+
+  // The :threads keyword is skipped, not evaluated.
+  value args[3];
+  ast_node *items[3] = {node->list.items[1], node->list.items[2],
+                        arg_count == 3 ? node->list.items[4] : NULL};
+  result args_result = eval_arguments(ctx, env, items, args, arg_count);
+  if (args_result.is_error)
+    return args_result;
+
+  size_t thread_count = 1;
+  result res;
+  if (args[0].type != value_type_string) {
+    res = create_error_result("Expected a file path");
+  } else if (args[1].type != value_type_function) {
+    res = create_error_result("Expected a function");
+  } else if (arg_count == 3 &&
+             (args[2].type != value_type_int || args[2].int_value < 1)) {
+    res = create_error_result(":threads expects a positive integer");
+  } else {
+    if (arg_count == 3) {
+      thread_count = (size_t)args[2].int_value;
+    } else if (is_map) {
+      thread_count = online_cpu_count();
+    }
+    res = map_file_lines(ctx, args[0].string_value,
+                         args[1].function_value, is_map, thread_count);
+  }
+  for (size_t i = 0; i < arg_count; i++) {
+    free_value(args[i]);
+  }
+  return res;
+}
+
+int is_vector_builtin(const char *name);
+result eval_vector_builtin(context *ctx, environment *env, ast_node *node);
+
+result eval_ast_node(context *ctx, environment *env, ast_node *node) {
+  if (ctx->sandbox) {
+    const char *error = check_sandbox(ctx->sandbox, 0);
+    if (error)
+      return create_error_result(error);
+  }
+
+  if (node->type == node_type_int) {
+    return create_success_result(create_int_value(node->int_value));
+  } else if (node->type == node_type_string) {
+    return create_success_result(create_string_value(node->symbol_value));
+  } else if (node->type == node_type_symbol) {
+    return lookup_symbol(ctx, env, node->symbol_value);
+  } else if (node->type == node_type_list) {
+    if (node->list.length == 0) {
+      return create_error_result("Cannot evaluate an empty list");
+    }
+
+    ast_node *op = node->list.items[0];
+    if (op->type != node_type_symbol) {
+      return create_error_result(
+          "First element of a list must be a symbol (operator)");
+    }
+
+    if (ctx->sandbox && !sandbox_allows(ctx->sandbox, op->symbol_value))
+      return create_error_result("Operator is not allowed in the sandbox");
+
+    if (strcmp(op->symbol_value, "define") == 0) {
+      return eval_define(ctx, env, node);
+    } else if (strcmp(op->symbol_value, "load") == 0) {
+      if (node->list.length != 2)
+        return create_error_result("load expects a file path");
+
+      result path_result = eval_ast_node(ctx, env, node->list.items[1]);
+      if (path_result.is_error)
+        return path_result;
+
+      if (path_result.result_value.type != value_type_string) {
+        free_result(path_result);
+        return create_error_result("Non-string argument to load");
+      }
+
+      result load_result =
+          load_yalisp_file(ctx, path_result.result_value.string_value);
+      free_result(path_result);
+      return load_result;
+    } else if (strcmp(op->symbol_value, "reclaim-stats") == 0) {
+      char stats[256];
+      snprintf(stats, sizeof(stats),
+               "pauses: %zu, max: %lluus, p99: <%lluus, pending: %zu, "
+               "compactions: %zu, reclaimed: %zu bytes in %lluus, "
+               "finalized: %zu",
+               ctx->reclaim_pauses.count,
+               (unsigned long long)ctx->reclaim_pauses.max_us,
+               (unsigned long long)pause_p99_microseconds(&ctx->reclaim_pauses),
+               ctx->retired.length, ctx->compaction_count,
+               ctx->compaction_totals.bytes_reclaimed,
+               (unsigned long long)ctx->compaction_totals.duration_us,
+               ctx->finalizers.finalized_count);
+      return create_success_result(create_string_value(stats));
+    } else if (strcmp(op->symbol_value, "weak-ref") == 0 ||
+               strcmp(op->symbol_value, "weak-get") == 0) {
+      int is_get = op->symbol_value[5] == 'g';
+      if (node->list.length != 2)
+        return create_error_result(is_get ? "weak-get expects a weak ref"
+                                          : "weak-ref expects a handle");
+
+      result arg_result = eval_ast_node(ctx, env, node->list.items[1]);
+      if (arg_result.is_error)
+        return arg_result;
+
+      value arg = arg_result.result_value;
+      if (arg.type != (is_get ? value_type_weak_ref : value_type_handle)) {
+        free_result(arg_result);
+        return create_error_result(is_get ? "Non-weak-ref argument to weak-get"
+                                          : "Non-handle argument to weak-ref");
+      }
+
+      value val;
+      if (!is_get) {
+        val = create_weak_ref_value(arg.handle_value);
+      } else if (!get_weak_ref_target(arg.weak_ref_value, &val)) {
+        val = create_int_value(0);
+      }
+      free_result(arg_result);
+      return create_success_result(val);
+    } else if (strcmp(op->symbol_value, "heap-stats") == 0) {
+      heap_kind_stats stats[heap_kind_count];
+      collect_heap_stats(stats);
+
+      // Room for two 20 digit counts and a kind name per entry; a report
+      // that still doesn't fit is cut short.
+      char report[heap_kind_count * 80];
+      size_t length = 0;
+      for (size_t i = 0; i < heap_kind_count && length < sizeof(report); i++) {
+        length += snprintf(report + length, sizeof(report) - length,
+                           "%s%s: %zu (%zu bytes)", i ? ", " : "",
+                           heap_kind_names[i], stats[i].count, stats[i].bytes);
+      }
+      return create_success_result(create_string_value(report));
+    } else if (strcmp(op->symbol_value, "heap-dump") == 0) {
+      if (node->list.length != 2)
+        return create_error_result("heap-dump expects a file path");
+
+      result path_result = eval_ast_node(ctx, env, node->list.items[1]);
+      if (path_result.is_error)
+        return path_result;
+
+      if (path_result.result_value.type != value_type_string) {
+        free_result(path_result);
+        return create_error_result("Non-string argument to heap-dump");
+      }
+
+      result dump_result =
+          write_heap_dump(ctx, path_result.result_value.string_value);
+      free_result(path_result);
+      return dump_result;
+    } else if (strcmp(op->symbol_value, "compact-heap") == 0) {
+      heap_compaction compaction = compact_context_heap(ctx);
+      return create_success_result(
+          create_int_value((int)compaction.bytes_reclaimed));
+    } else if (strcmp(op->symbol_value, "+") == 0) {
+      int sum = 0;
+
+      for (size_t i = 1; i < node->list.length; i++) {
+        result arg_result = eval_ast_node(ctx, env, node->list.items[i]);
+
+        if (arg_result.is_error)
+          return arg_result;
+
+        if (arg_result.result_value.type != value_type_int)
+          return create_error_result("Non-integer argument to +");
+
+        sum += arg_result.result_value.int_value;
+        free_result(arg_result);
+      }
+
+      return create_success_result(create_int_value(sum));
+    } else if (strcmp(op->symbol_value, "-") == 0) {
+      result arg_result = eval_ast_node(ctx, env, node->list.items[1]);
+
+      if (arg_result.is_error)
+        return arg_result;
+
+      if (arg_result.result_value.type != value_type_int)
+        return create_error_result("Non-integer argument to +");
+
+      int diff = arg_result.result_value.int_value;
+      free_result(arg_result);
+
+      for (size_t i = 2; i < node->list.length; i++) {
+        result arg_result = eval_ast_node(ctx, env, node->list.items[i]);
+
+        if (arg_result.is_error)
+          return arg_result;
+
+        if (arg_result.result_value.type != value_type_int)
+          return create_error_result("Non-integer argument to +");
+
+        diff -= arg_result.result_value.int_value;
+        free_result(arg_result);
+      }
+
+      return create_success_result(create_int_value(diff));
+    } else if (strcmp(op->symbol_value, "concat") == 0) {
+      size_t count = node->list.length - 1;
+      value *args = heap_allocate(heap_kind_frame, sizeof(value) * count);
+      result res = eval_arguments(ctx, env, node->list.items + 1, args, count);
+      if (res.is_error) {
+        heap_free(heap_kind_frame, args, sizeof(value) * count);
+        return res;
+      }
+
+      size_t total_length = 0;
+      for (size_t i = 0; i < count && !res.is_error; i++) {
+        if (args[i].type != value_type_string) {
+          free_result(res);
+          res = create_error_result("Non-string argument to concat");
+        } else {
+          total_length += strlen(args[i].string_value);
+        }
+      }
+
+      if (!res.is_error) {
+        char *result_string = heap_allocate_string(total_length);
+        size_t length = 0;
+        for (size_t i = 0; i < count; i++) {
+          size_t arg_length = strlen(args[i].string_value);
+          memcpy(result_string + length, args[i].string_value, arg_length);
+          length += arg_length;
+        }
+        result_string[length] = '\0';
+
+        value val;
+        val.type = value_type_string;
+        val.string_value = result_string;
+        res = create_success_result(val);
+      }
+
+      for (size_t i = 0; i < count; i++) {
+        free_value(args[i]);
+      }
+      heap_free(heap_kind_frame, args, sizeof(value) * count);
+      return res;
+    } else if (is_bytevector_builtin(op->symbol_value)) {
+      return eval_bytevector_builtin(ctx, env, node);
+    } else if (strcmp(op->symbol_value, "for-each-line") == 0 ||
+               strcmp(op->symbol_value, "map-lines") == 0) {
+      return eval_line_builtin(ctx, env, node);
+    } else if (is_sketch_builtin(op->symbol_value)) {
+      return eval_sketch_builtin(ctx, env, node);
+    } else if (is_matcher_builtin(op->symbol_value)) {
+      return eval_matcher_builtin(ctx, env, node);
+    } else if (is_vector_builtin(op->symbol_value)) {
+      return eval_vector_builtin(ctx, env, node);
+    } else {
+      result callee = lookup_symbol(ctx, env, op->symbol_value);
+      if (callee.is_error) {
+        free_result(callee);
+        return create_error_result("Unknown operator");
+      }
+
+      if (callee.result_value.type != value_type_function) {
+        free_result(callee);
+        return create_error_result("Cannot call a non-function value");
+      }
+
+      result res =
+          call_function(ctx, env, callee.result_value.function_value, node);
+      free_result(callee);
+      return res;
+    }
+  }
+
+  return create_error_result("Unknown AST node type");
+}
+
+// Returns the position right after the form starting at `pos` without
+// building it, so unchanged forms of a reloaded file never hit the parser.
+size_t skip_form(const char *input, size_t pos) {
+  size_t depth = 0;
+  do {
+    char c = input[pos];
+    if (c == '\0') {
+      break;
+    } else if (c == '"') {
+      pos++;
+      while (input[pos] != '"' && input[pos] != '\0')
+        pos++;
+      if (input[pos] == '"')
+        pos++;
+    } else if (c == '(') {
+      depth++;
+      pos++;
+    } else if (c == ')') {
+      pos++;
+      if (depth == 0)
+        break;
+      depth--;
+    } else if (c == ';') {
+      while (input[pos] != '\n' && input[pos] != '\0')
+        pos++;
+    } else if (depth == 0) {
+      while (!is_symbol_end(input[pos]))
+        pos++;
+    } else {
+      pos++;
+    }
+  } while (depth > 0);
+  return pos;
+}
+
+char *read_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return NULL;
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *contents = malloc(size + 1);
+  size_t read = fread(contents, 1, size, file);
+  contents[read] = '\0';
+  fclose(file);
+  return contents;
+}
+
+loaded_file *find_file(loaded_file *files, size_t count, const char *path) {
+  for (size_t i = 0; i < count; i++) {
+    if (strcmp(files[i].path, path) == 0)
+      return &files[i];
+  }
+  return NULL;
+}
+
+loaded_file *find_loaded_file(context *ctx, const char *path) {
+  loaded_file *file =
+      find_file(ctx->staged_files, ctx->staged_file_count, path);
+  return file ? file : find_file(ctx->files, ctx->file_count, path);
+}
+
+// Takes ownership of `file`, replacing the entry of the same path.
+void store_loaded_file(loaded_file **files, size_t *count, loaded_file file) {
+  loaded_file *stored = find_file(*files, *count, file.path);
+  if (stored) {
+    free_loaded_file(stored);
+  } else {
+    *files = realloc(*files, sizeof(loaded_file) * (*count + 1));
+    stored = &(*files)[(*count)++];
+  }
+  *stored = file;
+}
+
+typedef struct form_index {
+  size_t *slots; // indices into the forms, SIZE_MAX for an empty slot
+  size_t capacity;
+} form_index;
+
+uint64_t form_key(loaded_form *form, int by_ast) {
+  return by_ast ? form->ast_hash : form->source_hash;
+}
+
+// Indexes the evaluated forms by either their source hash or their AST hash.
+form_index create_form_index(loaded_form *forms, size_t count, int by_ast) {
+  form_index index;
+  index.capacity = 1;
+  while (index.capacity < count * 2)
+    index.capacity *= 2;
+  index.slots = malloc(sizeof(size_t) * index.capacity);
+  for (size_t i = 0; i < index.capacity; i++)
+    index.slots[i] = SIZE_MAX;
+
+  for (size_t i = 0; i < count; i++) {
+    if (!forms[i].is_evaluated)
+      continue;
+    size_t slot = form_key(&forms[i], by_ast) & (index.capacity - 1);
+    while (index.slots[slot] != SIZE_MAX)
+      slot = (slot + 1) & (index.capacity - 1);
+    index.slots[slot] = i;
+  }
+  return index;
+}
+
+loaded_form *find_indexed_form(form_index *index, loaded_form *forms,
+                               loaded_form *form, int by_ast) {
+  uint64_t key = form_key(form, by_ast);
+  size_t slot = key & (index->capacity - 1);
+  while (index->slots[slot] != SIZE_MAX) {
+    loaded_form *old = &forms[index->slots[slot]];
+    if (form_key(old, by_ast) == key &&
+        (by_ast || strcmp(old->source, form->source) == 0))
+      return old;
+    slot = (slot + 1) & (index->capacity - 1);
+  }
+  return NULL;
+}
+
+void commit_staged_globals(context *ctx, global_table *staged) {
+  for (size_t i = 0; i < staged->capacity; i++) {
+    if (staged->entries[i].name != NULL) {
+      value replaced;
+      if (set_global(&ctx->globals, staged->entries[i].name,
+                     staged->entries[i].val, &replaced))
+        retire_value(&ctx->retired, replaced);
+      free(staged->entries[i].name);
+    }
+  }
+  free(staged->entries);
+}
+
+// Evaluates every top-level form of a file. When the file was loaded before,
+// forms whose source is unchanged are neither parsed nor evaluated again, and
+// forms that only changed in layout or comments (same AST hash) are parsed
+// but not evaluated. Forms that depend on a changed definition are not
+// re-evaluated unless they changed themselves.
+//
+// Definitions made by the file are staged and swapped into the globals all at
+// once when the whole file evaluated successfully; on error the globals are
+// left as they were. Values already handed out keep the old functions alive,
+// so evaluations that started before the reload finish on the old code.
+// Returns the number of evaluated forms.
+result load_yalisp_file(context *ctx, const char *path) {
+  char *input = read_file(path);
+  if (!input)
+    return create_error_result("Cannot read file");
+
+  loaded_file *previous = find_loaded_file(ctx, path);
+  loaded_form *previous_forms = previous ? previous->forms : NULL;
+  size_t previous_count = previous ? previous->form_count : 0;
+  form_index by_source = create_form_index(previous_forms, previous_count, 0);
+  form_index by_ast = create_form_index(previous_forms, previous_count, 1);
+
+  global_table staged = {NULL, 0, 0};
+  global_table *outer_staged = ctx->staged_globals;
+  if (outer_staged == NULL)
+    ctx->staged_globals = &staged;
+
+  loaded_form *forms = NULL;
+  size_t form_count = 0;
+  int evaluated = 0;
+  result res = create_success_result(create_int_value(0));
+
+  size_t pos = 0;
+  while (!res.is_error) {
+    skip_whitespace(input, &pos);
+    if (input[pos] == '\0')
+      break;
+
+    size_t start = pos;
+    pos = skip_form(input, pos);
+
+    loaded_form form;
+    form.source = strndup(input + start, pos - start);
+    form.source_hash = hash_string(form.source);
+    form.ast_hash = 0;
+    form.is_evaluated = 0;
+
+    // Unchanged source: the old AST hash still applies.
+    loaded_form *old =
+        find_indexed_form(&by_source, previous_forms, &form, 0);
+    if (old != NULL) {
+      form.ast_hash = old->ast_hash;
+      form.is_evaluated = 1;
+    }
+
+    if (!form.is_evaluated) {
+      size_t form_pos = 0;
+      parse_result parsed = parse_interned(form.source, &form_pos,
+                                           ctx->interner);
+      if (parsed.is_error) {
+        free_result(res);
+        res = create_error_result(parsed.error_message);
+      } else {
+        form.ast_hash = hash_ast_node(parsed.node);
+        form.is_evaluated =
+            find_indexed_form(&by_ast, previous_forms, &form, 1) != NULL;
+      }
+
+      if (!parsed.is_error && !form.is_evaluated) {
+        result form_result = eval_ast_node(ctx, NULL, parsed.node);
+        if (form_result.is_error) {
+          free_result(res);
+          res = form_result;
+        } else {
+          free_result(form_result);
+          form.is_evaluated = 1;
+          evaluated++;
+        }
+      }
+      free_parse_result(parsed);
+    }
+
+    forms = realloc(forms, sizeof(loaded_form) * (form_count + 1));
+    forms[form_count++] = form;
+  }
+
+  free(by_source.slots);
+  free(by_ast.slots);
+  free(input);
+
+  // A failed load leaves the globals as of the previous load, so the cached
+  // forms have to stay the previous ones too. The same goes for the files a
+  // file loads, whose definitions are staged along with its own.
+  loaded_file file = {strdup(path), forms, form_count};
+  if (res.is_error) {
+    free_loaded_file(&file);
+  } else if (outer_staged != NULL) {
+    store_loaded_file(&ctx->staged_files, &ctx->staged_file_count, file);
+  } else {
+    store_loaded_file(&ctx->files, &ctx->file_count, file);
+  }
+
+  if (outer_staged == NULL) {
+    ctx->staged_globals = NULL;
+    if (res.is_error) {
+      free_global_table(&staged);
+    } else {
+      commit_staged_globals(ctx, &staged);
+    }
+
+    for (size_t i = 0; i < ctx->staged_file_count; i++) {
+      if (res.is_error) {
+        free_loaded_file(&ctx->staged_files[i]);
+      } else {
+        store_loaded_file(&ctx->files, &ctx->file_count,
+                          ctx->staged_files[i]);
+      }
+    }
+    free(ctx->staged_files);
+    ctx->staged_files = NULL;
+    ctx->staged_file_count = 0;
+  }
+
+  if (res.is_error)
+    return res;
+
+  free_result(res);
+  return create_success_result(create_int_value(evaluated));
+}
+
+typedef struct batch {
+  context *ctx;
+  ast_node *form;
+  char **parameters;
+  size_t parameter_count;
+  value *rows;
+  result *results;
+  size_t begin;
+  size_t end;
+} batch;
+
+void eval_batch_rows(batch *job) {
+  // One frame for all rows: binding a row only repoints its values.
+  environment frame = {job->parameters, NULL, job->parameter_count};
+  for (size_t i = job->begin; i < job->end; i++) {
+    frame.values = job->rows + i * job->parameter_count;
+    job->results[i] = eval_ast_node(job->ctx, &frame, job->form);
+  }
+}
+
+void *eval_batch_thread(void *data) {
+  batch *job = data;
+  eval_batch_rows(job);
+  free_context(job->ctx);
+  return NULL;
+}
+
+// Evaluates `form` once per row, with `parameters` bound to the row's values.
+// `rows` holds `row_count` rows of `parameter_count` values each and is only
+// read. Returns one result per row, which the caller frees.
+//
+// With more than one thread the rows are split between threads, each
+// evaluating in its own child context of `ctx`. The context is only read
+// then, so it must not be used elsewhere until the call returns, and
+// definitions made by the form are dropped with the children.
+result *eval_batch(context *ctx, ast_node *form, char **parameters,
+                   size_t parameter_count, value *rows, size_t row_count,
+                   size_t thread_count) {
+  result *results = malloc(sizeof(result) * (row_count ? row_count : 1));
+  if (thread_count > row_count)
+    thread_count = row_count;
+
+  if (thread_count <= 1) {
+    batch job = {ctx,  form,    parameters, parameter_count,
+                 rows, results, 0,          row_count};
+    eval_batch_rows(&job);
+    return results;
+  }
+
+  batch *jobs = malloc(sizeof(batch) * thread_count);
+  pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+  for (size_t i = 0; i < thread_count; i++) {
+    batch job = {create_child_context(ctx),
+                 form,
+                 parameters,
+                 parameter_count,
+                 rows,
+                 results,
+                 row_count * i / thread_count,
+                 row_count * (i + 1) / thread_count};
+    jobs[i] = job;
+    if (pthread_create(&threads[i], NULL, eval_batch_thread, &jobs[i]) != 0) {
+      eval_batch_thread(&jobs[i]);
+      threads[i] = pthread_self();
+    }
+  }
+
+  for (size_t i = 0; i < thread_count; i++) {
+    if (!pthread_equal(threads[i], pthread_self()))
+      pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  free(jobs);
+  // A cancel stopped the rows the children hadn't finished, which report it.
+  // It's served here so that it doesn't stop the next evaluation too.
+  serve_interrupts(ctx);
+  return results;
+}
+
+// Column-at-a-time evaluation of pure integer arithmetic. A form made of +, -,
+// integer literals and column names compiles into a flat plan of column
+// operations, which then runs over a block of rows at a time with simple
+// loops the compiler turns into SIMD code. Arithmetic wraps around instead
+// of overflowing.
+
+#define VECTOR_BLOCK_SIZE 1024
+
+typedef enum {
+  vector_op_column,   // target = columns[column]
+  vector_op_constant, // target = constant
+  vector_op_add,      // target = left + right
+  vector_op_subtract  // target = left - right
+} vector_op;
+
+typedef struct vector_instruction {
+  vector_op op;
+  size_t target;
+  size_t left;
+  size_t right;
+  size_t column;
+  int constant;
+} vector_instruction;
+
+typedef struct vector_plan {
+  vector_instruction *instructions;
+  size_t instruction_count;
+  size_t register_count; // the result ends up in the last one
+} vector_plan;
+
+size_t emit_vector_instruction(vector_plan *plan, vector_instruction ins) {
+  ins.target = plan->register_count++;
+  plan->instructions =
+      realloc(plan->instructions,
+              sizeof(vector_instruction) * (plan->instruction_count + 1));
+  plan->instructions[plan->instruction_count++] = ins;
+  return ins.target;
+}
+
+// Returns the register holding the node's value, or SIZE_MAX if the node
+// can't be vectorized.
+size_t compile_vector_node(vector_plan *plan, ast_node *node,
+                           char **column_names, size_t column_count) {
+  vector_instruction ins = {vector_op_constant, 0, 0, 0, 0, 0};
+  if (node->type == node_type_int) {
+    ins.constant = node->int_value;
+    return emit_vector_instruction(plan, ins);
+  } else if (node->type == node_type_symbol) {
+    for (size_t i = 0; i < column_count; i++) {
+      if (strcmp(column_names[i], node->symbol_value) == 0) {
+        ins.op = vector_op_column;
+        ins.column = i;
+        return emit_vector_instruction(plan, ins);
+      }
+    }
+    return SIZE_MAX;
+  } else if (node->type != node_type_list || node->list.length == 0 ||
+             node->list.items[0]->type != node_type_symbol) {
+    return SIZE_MAX;
+  }
+
+  const char *op = node->list.items[0]->symbol_value;
+  int is_add = strcmp(op, "+") == 0;
+  if (!is_add && (strcmp(op, "-") != 0 || node->list.length < 2))
+    return SIZE_MAX;
+
+  // Same semantics as the interpreter: (+) is 0 and (- x) is x.
+  if (node->list.length == 1)
+    return emit_vector_instruction(plan, ins);
+
+  size_t accumulator = compile_vector_node(plan, node->list.items[1],
+                                           column_names, column_count);
+  for (size_t i = 2; i < node->list.length && accumulator != SIZE_MAX; i++) {
+    size_t operand = compile_vector_node(plan, node->list.items[i],
+                                         column_names, column_count);
+    if (operand == SIZE_MAX)
+      return SIZE_MAX;
+
+    ins.op = is_add ? vector_op_add : vector_op_subtract;
+    ins.left = accumulator;
+    ins.right = operand;
+    accumulator = emit_vector_instruction(plan, ins);
+  }
+  return accumulator;
+}
+
+void free_vector_plan(vector_plan *plan) {
+  free(plan->instructions);
+  free(plan);
+}
+
+// Returns NULL when the form uses anything but +, -, integer literals and
+// the given column names; such forms have to be evaluated row by row.
+vector_plan *compile_vector_plan(ast_node *form, char **column_names,
+                                 size_t column_count) {
+  vector_plan *plan = calloc(1, sizeof(vector_plan));
+  if (compile_vector_node(plan, form, column_names, column_count) ==
+      SIZE_MAX) {
+    free_vector_plan(plan);
+    return NULL;
+  }
+  return plan;
+}
+
+// Evaluates the plan for `row_count` rows. `columns` holds one array per
+// column name the plan was compiled with, and results go to `output`.
+void run_vector_plan(const vector_plan *plan, const int *const *columns,
+                     size_t row_count, int *output) {
+  int *scratch = malloc(sizeof(int) * VECTOR_BLOCK_SIZE * plan->register_count);
+  const int **registers = malloc(sizeof(int *) * plan->register_count);
+
+  for (size_t start = 0; start < row_count; start += VECTOR_BLOCK_SIZE) {
+    size_t length = row_count - start < VECTOR_BLOCK_SIZE
+                        ? row_count - start
+                        : VECTOR_BLOCK_SIZE;
+
+    for (size_t i = 0; i < plan->instruction_count; i++) {
+      const vector_instruction *ins = &plan->instructions[i];
+      int *target = scratch + ins->target * VECTOR_BLOCK_SIZE;
+      if (ins->target == plan->register_count - 1)
+        target = output + start;
+      registers[ins->target] = target;
+
+      if (ins->op == vector_op_column) {
+        if (target == output + start) {
+          memcpy(target, columns[ins->column] + start, sizeof(int) * length);
+        } else {
+          // Columns are read in place.
+          registers[ins->target] = columns[ins->column] + start;
+        }
+      } else if (ins->op == vector_op_constant) {
+        for (size_t j = 0; j < length; j++)
+          target[j] = ins->constant;
+      } else {
+        const int *left = registers[ins->left];
+        const int *right = registers[ins->right];
+        if (ins->op == vector_op_add) {
+          for (size_t j = 0; j < length; j++)
+            target[j] = (int)((unsigned)left[j] + (unsigned)right[j]);
+        } else {
+          for (size_t j = 0; j < length; j++)
+            target[j] = (int)((unsigned)left[j] - (unsigned)right[j]);
+        }
+      }
+    }
+  }
+
+  free(registers);
+  free(scratch);
+}
+
+// Tiered execution. Functions start out interpreted straight from their AST.
+// After TIER_BASELINE_CALLS calls their body is compiled into a tree of
+// resolved operations: parameters become slots, literals constants, + and -
+// direct arithmetic, calls skip the builtin dispatch, and everything else
+// stays with the interpreter. After TIER_OPTIMIZED_CALLS calls, a function
+// whose body is integer arithmetic over its parameters and that was only
+// ever called with integers is compiled further into a straight-line plan
+// over unboxed integers. The plan is guarded by a check of the argument
+// types, and a call that fails it deoptimizes the function back to its
+// baseline code for good. Compiled code is never changed once published, so
+// it's shared by all threads calling the function.
+
+#define TIER_BASELINE_CALLS 16
+#define TIER_OPTIMIZED_CALLS 1000
+#define TIER_MAX_REGISTERS 64
+
+typedef enum {
+  compiled_op_constant,
+  compiled_op_string,
+  compiled_op_parameter,
+  compiled_op_global,
+  compiled_op_add,
+  compiled_op_subtract,
+  compiled_op_call,       // of a function looked up by name at run time
+  compiled_op_interpreted // evaluated by the interpreter
+} compiled_op;
+
+typedef struct compiled_node {
+  compiled_op op;
+  int constant;
+  size_t slot;
+  ast_node *node; // borrowed from the function's body
+  struct compiled_node **operands;
+  size_t operand_count;
+} compiled_node;
+
+typedef struct function_code {
+  compiled_node **body;
+  size_t body_length;
+  atomic_int is_final; // set once optimizing was attempted
+  _Atomic(vector_plan *) plan;
+  atomic_int is_deoptimized;
+} function_code;
+
+compiled_node *compile_node(function *fn, ast_node *node) {
+  compiled_node *compiled = calloc(1, sizeof(compiled_node));
+  compiled->node = node;
+  compiled->op = compiled_op_interpreted;
+  if (node->type == node_type_int) {
+    compiled->op = compiled_op_constant;
+    compiled->constant = node->int_value;
+    return compiled;
+  } else if (node->type == node_type_string) {
+    compiled->op = compiled_op_string;
+    return compiled;
+  }
+
+  const char *name = NULL;
+  if (node->type == node_type_symbol) {
+    name = node->symbol_value;
+  } else if (node->list.length > 0 &&
+             node->list.items[0]->type == node_type_symbol) {
+    name = node->list.items[0]->symbol_value;
+  } else {
+    return compiled;
+  }
+
+  // Parameters shadow globals, and the first one of a name wins, as in
+  // lookup_symbol.
+  size_t slot = SIZE_MAX;
+  for (size_t i = 0; i < fn->parameter_count && slot == SIZE_MAX; i++) {
+    if (strcmp(fn->parameters[i], name) == 0)
+      slot = i;
+  }
+  if (node->type == node_type_symbol) {
+    compiled->op =
+        slot != SIZE_MAX ? compiled_op_parameter : compiled_op_global;
+    compiled->slot = slot;
+    return compiled;
+  }
+
+  // Builtins take precedence over functions of the same name, as in
+  // eval_ast_node. (-) without arguments is left to the interpreter.
+  if (strcmp(name, "+") == 0) {
+    compiled->op = compiled_op_add;
+  } else if (strcmp(name, "-") == 0 && node->list.length > 1) {
+    compiled->op = compiled_op_subtract;
+  } else if (!find_builtin(name) && slot == SIZE_MAX) {
+    compiled->op = compiled_op_call;
+  } else {
+    return compiled;
+  }
+
+  compiled->operand_count = node->list.length - 1;
+  compiled->operands =
+      malloc(sizeof(compiled_node *) * (compiled->operand_count + 1));
+  for (size_t i = 0; i < compiled->operand_count; i++)
+    compiled->operands[i] = compile_node(fn, node->list.items[i + 1]);
+  return compiled;
+}
+
+void free_compiled_node(compiled_node *compiled) {
+  for (size_t i = 0; i < compiled->operand_count; i++)
+    free_compiled_node(compiled->operands[i]);
+  free(compiled->operands);
+  free(compiled);
+}
+
+void free_function_code(function_code *code) {
+  for (size_t i = 0; i < code->body_length; i++)
+    free_compiled_node(code->body[i]);
+  free(code->body);
+  vector_plan *plan = atomic_load(&code->plan);
+  if (plan)
+    free_vector_plan(plan);
+  free(code);
+}
+
+// Compiles the baseline code unless another thread already did, and returns
+// the function's code.
+function_code *install_baseline_code(function *fn) {
+  function_code *installed = atomic_load(&fn->code);
+  if (installed)
+    return installed;
+
+  function_code *code = malloc(sizeof(function_code));
+  code->body_length = fn->body_length;
+  code->body = malloc(sizeof(compiled_node *) * (fn->body_length + 1));
+  for (size_t i = 0; i < fn->body_length; i++)
+    code->body[i] = compile_node(fn, fn->body[i]);
+  atomic_init(&code->is_final, 0);
+  atomic_init(&code->plan, NULL);
+  atomic_init(&code->is_deoptimized, 0);
+
+  if (!atomic_compare_exchange_strong(&fn->code, &installed, code)) {
+    free_function_code(code);
+    return installed;
+  }
+  return code;
+}
+
+void optimize_function_code(function *fn, function_code *code) {
+  if (atomic_exchange(&code->is_final, 1))
+    return;
+  if (fn->body_length != 1 || atomic_load(&fn->saw_non_int_argument))
+    return;
+
+  vector_plan *plan =
+      compile_vector_plan(fn->body[0], fn->parameters, fn->parameter_count);
+  if (plan && plan->register_count > TIER_MAX_REGISTERS) {
+    free_vector_plan(plan);
+    plan = NULL;
+  }
+  if (plan)
+    atomic_store_explicit(&code->plan, plan, memory_order_release);
+}
+
+// Counts the call, records its argument types and tiers the function up when
+// it's due. Returns the code to run instead of interpreting the body, or
+// NULL. Once optimizing was attempted there's nothing left to learn, and
+// the profile is left alone so calls from many threads don't contend on it.
+function_code *profile_call(function *fn, const value *arguments) {
+  function_code *code = atomic_load_explicit(&fn->code, memory_order_acquire);
+  if (fn->is_immortal ||
+      (code && atomic_load_explicit(&code->is_final, memory_order_relaxed)))
+    return code;
+
+  if (!atomic_load_explicit(&fn->saw_non_int_argument,
+                            memory_order_relaxed)) {
+    for (size_t i = 0; i < fn->parameter_count; i++) {
+      if (arguments[i].type != value_type_int)
+        atomic_store_explicit(&fn->saw_non_int_argument, 1,
+                              memory_order_relaxed);
+    }
+  }
+
+  size_t calls =
+      atomic_fetch_add_explicit(&fn->call_count, 1, memory_order_relaxed) + 1;
+  if (!code && calls >= TIER_BASELINE_CALLS)
+    code = install_baseline_code(fn);
+  if (code && calls >= TIER_OPTIMIZED_CALLS)
+    optimize_function_code(fn, code);
+  return code;
+}
+
+// Runs an optimized plan for one row, with the registers on the stack.
+int run_scalar_plan(const vector_plan *plan, const value *arguments) {
+  int registers[TIER_MAX_REGISTERS];
+  for (size_t i = 0; i < plan->instruction_count; i++) {
+    const vector_instruction *ins = &plan->instructions[i];
+    if (ins->op == vector_op_column) {
+      registers[ins->target] = arguments[ins->column].int_value;
+    } else if (ins->op == vector_op_constant) {
+      registers[ins->target] = ins->constant;
+    } else if (ins->op == vector_op_add) {
+      registers[ins->target] = (int)((unsigned)registers[ins->left] +
+                                     (unsigned)registers[ins->right]);
+    } else {
+      registers[ins->target] = (int)((unsigned)registers[ins->left] -
+                                     (unsigned)registers[ins->right]);
+    }
+  }
+  return registers[plan->register_count - 1];
+}
+
+result eval_compiled_node(context *ctx, environment *env,
+                          compiled_node *compiled) {
+  if (compiled->op == compiled_op_constant) {
+    return create_success_result(create_int_value(compiled->constant));
+  } else if (compiled->op == compiled_op_string) {
+    return create_success_result(
+        create_string_value(compiled->node->string_value));
+  } else if (compiled->op == compiled_op_parameter) {
+    return create_success_result(copy_value(env->values[compiled->slot]));
+  } else if (compiled->op == compiled_op_global) {
+    return lookup_symbol(ctx, env, compiled->node->symbol_value);
+  } else if (compiled->op == compiled_op_interpreted) {
+    return eval_ast_node(ctx, env, compiled->node);
+  }
+
+  if (compiled->op == compiled_op_add || compiled->op == compiled_op_subtract) {
+    // Wraps around like the optimized plans do.
+    unsigned total = 0;
+    for (size_t i = 0; i < compiled->operand_count; i++) {
+      result arg_result = eval_compiled_node(ctx, env, compiled->operands[i]);
+      if (arg_result.is_error)
+        return arg_result;
+
+      if (arg_result.result_value.type != value_type_int) {
+        free_result(arg_result);
+        return create_error_result("Non-integer argument to +");
+      }
+
+      unsigned operand = (unsigned)arg_result.result_value.int_value;
+      total = compiled->op == compiled_op_add || i == 0 ? total + operand
+                                                        : total - operand;
+    }
+    return create_success_result(create_int_value((int)total));
+  }
+
+  const char *name = compiled->node->list.items[0]->symbol_value;
+  result callee = lookup_symbol(ctx, env, name);
+  if (callee.is_error) {
+    free_result(callee);
+    return create_error_result("Unknown operator");
+  }
+
+  if (callee.result_value.type != value_type_function) {
+    free_result(callee);
+    return create_error_result("Cannot call a non-function value");
+  }
+
+  function *fn = callee.result_value.function_value;
+  if (compiled->operand_count != fn->parameter_count) {
+    free_result(callee);
+    return create_error_result("Wrong number of arguments");
+  }
+
+  value *arguments =
+      heap_allocate(heap_kind_frame, sizeof(value) * fn->parameter_count);
+  result res = create_success_result(create_int_value(0));
+  size_t evaluated = 0;
+  while (evaluated < fn->parameter_count) {
+    result arg_result =
+        eval_compiled_node(ctx, env, compiled->operands[evaluated]);
+    if (arg_result.is_error) {
+      res = arg_result;
+      break;
+    }
+    arguments[evaluated++] = arg_result.result_value;
+  }
+
+  if (!res.is_error)
+    res = apply_function(ctx, fn, arguments);
+  for (size_t i = 0; i < evaluated; i++) {
+    free_value(arguments[i]);
+  }
+  heap_free(heap_kind_frame, arguments, sizeof(value) * fn->parameter_count);
+  free_result(callee);
+  return res;
+}
+
+result run_function_code(context *ctx, environment *env,
+                         function_code *code) {
+  vector_plan *plan = atomic_load_explicit(&code->plan, memory_order_acquire);
+  if (plan &&
+      !atomic_load_explicit(&code->is_deoptimized, memory_order_relaxed)) {
+    size_t i = 0;
+    while (i < env->length && env->values[i].type == value_type_int)
+      i++;
+    if (i == env->length)
+      return create_success_result(
+          create_int_value(run_scalar_plan(plan, env->values)));
+    atomic_store_explicit(&code->is_deoptimized, 1, memory_order_relaxed);
+  }
+
+  result res = create_success_result(create_int_value(0));
+  for (size_t i = 0; i < code->body_length && !res.is_error; i++) {
+    free_result(res);
+    res = eval_compiled_node(ctx, env, code->body[i]);
+  }
+  return res;
+}
+
+// Profiles persist what tiering learned across runs, so that a restarted
+// process compiles its hot functions as they're defined instead of after
+// they were called often enough again. The format is line based:
+//
+//   <function name> <call count> <1 if it saw a non-integer argument, or 0>
+//
+// Call counts stop growing once a function is optimized, so they only tell
+// how far up a function got. A name may be listed more than once, as when
+// several processes append to the same file; its entries are merged.
+
+int compare_function_profiles(const void *a, const void *b) {
+  return strcmp(((const function_profile *)a)->name,
+                ((const function_profile *)b)->name);
+}
+
+// Sorts the profiles and merges the ones of the same name, keeping the
+// highest call count. Returns the number of profiles left.
+size_t merge_function_profiles(function_profile *profiles, size_t count) {
+  if (count == 0)
+    return 0;
+
+  qsort(profiles, count, sizeof(function_profile), compare_function_profiles);
+  size_t length = 1;
+  for (size_t i = 1; i < count; i++) {
+    function_profile *last = &profiles[length - 1];
+    if (strcmp(last->name, profiles[i].name) != 0) {
+      profiles[length++] = profiles[i];
+      continue;
+    }
+
+    if (profiles[i].call_count > last->call_count)
+      last->call_count = profiles[i].call_count;
+    last->saw_non_int_argument |= profiles[i].saw_non_int_argument;
+    free(profiles[i].name);
+  }
+  return length;
+}
+
+// Looks through the context's profiles and then its preludes'.
+const function_profile *find_function_profile(const context *ctx,
+                                              const char *name) {
+  for (const context *scope = ctx; scope; scope = scope->prelude) {
+    if (scope->profile_count == 0)
+      continue;
+
+    function_profile key = {(char *)name, 0, 0};
+    const function_profile *profile =
+        bsearch(&key, scope->profiles, scope->profile_count,
+                sizeof(function_profile), compare_function_profiles);
+    if (profile)
+      return profile;
+  }
+  return NULL;
+}
+
+// Seeds the profile of a newly defined function and compiles it right away
+// if it was hot in a previous run.
+void warm_up_function(const context *ctx, function *fn) {
+  const function_profile *profile = find_function_profile(ctx, fn->name);
+  if (!profile)
+    return;
+
+  atomic_store(&fn->call_count, profile->call_count);
+  atomic_store(&fn->saw_non_int_argument, profile->saw_non_int_argument);
+  if (profile->call_count >= TIER_BASELINE_CALLS) {
+    function_code *code = install_baseline_code(fn);
+    if (profile->call_count >= TIER_OPTIMIZED_CALLS)
+      optimize_function_code(fn, code);
+  }
+}
+
+// Merges the profiles from `path` into the context's and warms up the
+// functions the context already defines. A missing file is an empty profile,
+// so the first run starts cold. Returns the number of profiles read.
+result load_function_profiles(context *ctx, const char *path) {
+  char *input = read_file(path);
+  if (!input) {
+    if (errno == ENOENT)
+      return create_success_result(create_int_value(0));
+    return create_error_result("Cannot read profile");
+  }
+
+  size_t count = ctx->profile_count;
+  size_t loaded = 0;
+  for (char *line = input; *line != '\0';) {
+    char *end = strchr(line, '\n');
+    if (end)
+      *end = '\0';
+
+    char *name_end = line;
+    while (*name_end != '\0' && *name_end != ' ')
+      name_end++;
+    unsigned long long calls;
+    int saw_non_int_argument;
+    if (name_end != line &&
+        sscanf(name_end, "%llu %d", &calls, &saw_non_int_argument) == 2) {
+      ctx->profiles = realloc(ctx->profiles,
+                              sizeof(function_profile) * (count + 1));
+      function_profile *profile = &ctx->profiles[count++];
+      profile->name = strndup(line, name_end - line);
+      profile->call_count = calls;
+      profile->saw_non_int_argument = saw_non_int_argument != 0;
+      loaded++;
+    }
+    line = end ? end + 1 : line + strlen(line);
+  }
+  free(input);
+  ctx->profile_count = merge_function_profiles(ctx->profiles, count);
+
+  // A frozen context's functions are shared and have their code already.
+  for (size_t i = 0; i < ctx->globals.capacity && !ctx->is_frozen; i++) {
+    binding *entry = &ctx->globals.entries[i];
+    if (entry->name && entry->val.type == value_type_function)
+      warm_up_function(ctx, entry->val.function_value);
+  }
+  return create_success_result(create_int_value((int)loaded));
+}
+
+void add_function_profile(function *fn, function_profile **profiles,
+                          size_t *count) {
+  *profiles = realloc(*profiles, sizeof(function_profile) * (*count + 1));
+  function_profile *profile = &(*profiles)[(*count)++];
+  profile->name = strdup(fn->name);
+  profile->call_count = atomic_load(&fn->call_count);
+  profile->saw_non_int_argument = atomic_load(&fn->saw_non_int_argument);
+}
+
+// Collects the profiles of the functions a context defines and of its copies
+// of prelude functions.
+void collect_function_profiles(const context *ctx,
+                               function_profile **profiles, size_t *count) {
+  for (size_t i = 0; i < ctx->globals.capacity; i++) {
+    const binding *entry = &ctx->globals.entries[i];
+    if (entry->name && entry->val.type == value_type_function)
+      add_function_profile(entry->val.function_value, profiles, count);
+  }
+  for (size_t i = 0; i < ctx->function_copy_capacity; i++) {
+    if (ctx->function_copies[i].copy)
+      add_function_profile(ctx->function_copies[i].copy, profiles, count);
+  }
+}
+
+// Writes the profiles of the functions the context defines or called from its
+// prelude, merged with the ones it loaded, so functions that weren't defined
+// in this run keep theirs. With `only_defined`, just the context's own
+// functions and copies are written; workers sharing a profile append those
+// and leave the merging to the next load.
+// Returns the number of profiles written.
+result write_function_profiles(const context *ctx, const char *path,
+                               int only_defined) {
+  function_profile *profiles = NULL;
+  size_t count = 0;
+  collect_function_profiles(ctx, &profiles, &count);
+  for (const context *scope = ctx; scope && !only_defined;
+       scope = scope->prelude) {
+    if (scope != ctx)
+      collect_function_profiles(scope, &profiles, &count);
+    for (size_t i = 0; i < scope->profile_count; i++) {
+      profiles = realloc(profiles, sizeof(function_profile) * (count + 1));
+      profiles[count] = scope->profiles[i];
+      profiles[count++].name = strdup(scope->profiles[i].name);
+    }
+  }
+  count = merge_function_profiles(profiles, count);
+
+  // Written with a single append, so lines of concurrent writers don't
+  // interleave.
+  char *output = NULL;
+  size_t length = 0;
+  FILE *buffer = open_memstream(&output, &length);
+  for (size_t i = 0; i < count; i++) {
+    fprintf(buffer, "%s %zu %d\n", profiles[i].name, profiles[i].call_count,
+            profiles[i].saw_non_int_argument);
+    free(profiles[i].name);
+  }
+  free(profiles);
+  fclose(buffer);
+
+  int flags = O_WRONLY | O_CREAT | O_APPEND | (only_defined ? 0 : O_TRUNC);
+  int fd = open(path, flags, 0644);
+  ssize_t written = fd < 0 ? -1 : write(fd, output, length);
+  free(output);
+  if (fd < 0 || close(fd) != 0 || written != (ssize_t)length)
+    return create_error_result("Cannot write profile");
+  return create_success_result(create_int_value((int)count));
+}
+
+// Hash aggregation and equi-joins over integer key columns, laid out like the
+// columns run_vector_plan reads. Big inputs are first split by the top bits of
+// the key hashes into partitions whose hash tables fit in cache, and the
+// partitions are then aggregated or joined by several threads at once.
+
+#define PARTITION_MIN_ROWS (16 * 1024)
+#define MAX_PARTITION_BITS 8
+
+size_t partition_bits(size_t row_count) {
+  size_t bits = 0;
+  while (bits < MAX_PARTITION_BITS && (row_count >> bits) > PARTITION_MIN_ROWS)
+    bits++;
+  return bits;
+}
+
+size_t partition_of(uint64_t hash, size_t bits) {
+  return bits ? (size_t)(hash >> (64 - bits)) : 0;
+}
+
+// Row indices grouped by partition. The rows of partition `i` are
+// rows[offsets[i]] up to rows[offsets[i + 1]], in their original order.
+typedef struct key_partitions {
+  size_t count;
+  size_t *offsets;
+  size_t *rows;
+} key_partitions;
+
+key_partitions partition_keys(const int *keys, size_t row_count, size_t bits) {
+  key_partitions parts = {(size_t)1 << bits, NULL, NULL};
+  parts.offsets = calloc(parts.count + 1, sizeof(size_t));
+  parts.rows = malloc(sizeof(size_t) * (row_count ? row_count : 1));
+  for (size_t i = 0; i < row_count; i++)
+    parts.offsets[partition_of(hash_key(keys[i]), bits) + 1]++;
+  for (size_t i = 0; i < parts.count; i++)
+    parts.offsets[i + 1] += parts.offsets[i];
+
+  size_t *cursors = malloc(sizeof(size_t) * parts.count);
+  memcpy(cursors, parts.offsets, sizeof(size_t) * parts.count);
+  for (size_t i = 0; i < row_count; i++)
+    parts.rows[cursors[partition_of(hash_key(keys[i]), bits)]++] = i;
+  free(cursors);
+  return parts;
+}
+
+void free_key_partitions(key_partitions *parts) {
+  free(parts->offsets);
+  free(parts->rows);
+}
+
+// Keys next to their ids, so a probe reads a single cache line. Id 0 marks an
+// empty slot.
+typedef struct key_slot {
+  int key;
+  uint32_t id;
+} key_slot;
+
+// Capacity for a table of at most `key_count` keys, at most half full.
+size_t key_table_capacity(size_t key_count) {
+  size_t capacity = 16;
+  while (capacity < key_count * 2)
+    capacity *= 2;
+  return capacity;
+}
+
+// Returns the slot holding `key`, or the empty slot where it belongs.
+key_slot *find_key_slot(key_slot *slots, size_t capacity, int key) {
+  size_t slot = hash_key(key) & (capacity - 1);
+  while (slots[slot].id != 0 && slots[slot].key != key)
+    slot = (slot + 1) & (capacity - 1);
+  return &slots[slot];
+}
+
+typedef struct partition_work {
+  void (*run)(void *jobs, size_t index);
+  void *jobs;
+  size_t count;
+  atomic_size_t next;
+} partition_work;
+
+void *run_partition_thread(void *data) {
+  partition_work *work = data;
+  size_t index;
+  while ((index = atomic_fetch_add_explicit(&work->next, 1,
+                                            memory_order_relaxed)) <
+         work->count)
+    work->run(work->jobs, index);
+  return NULL;
+}
+
+// Runs every partition job once. Threads take the next job when done with
+// one, so a few big partitions don't leave the other threads idle.
+void run_partitions(void (*run)(void *jobs, size_t index), void *jobs,
+                    size_t count, size_t thread_count) {
+  partition_work work = {run, jobs, count, 0};
+  if (thread_count > count)
+    thread_count = count;
+  if (thread_count <= 1) {
+    run_partition_thread(&work);
+    return;
+  }
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+  size_t started = 0;
+  while (started < thread_count - 1 &&
+         pthread_create(&threads[started], NULL, run_partition_thread,
+                        &work) == 0)
+    started++;
+  run_partition_thread(&work);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+typedef enum {
+  aggregate_kind_count,
+  aggregate_kind_sum,
+  aggregate_kind_min,
+  aggregate_kind_max,
+  aggregate_kind_avg
+} aggregate_kind;
+
+typedef struct aggregate {
+  aggregate_kind kind;
+  size_t column; // not used by aggregate_kind_count
+} aggregate;
+
+typedef union aggregate_value {
+  int64_t integer;
+  double average; // for aggregate_kind_avg
+} aggregate_value;
+
+// One row per distinct key, in no particular order. `values` holds
+// `aggregate_count` values per group.
+typedef struct group_table {
+  size_t group_count;
+  size_t aggregate_count;
+  int *keys;
+  aggregate_value *values;
+} group_table;
+
+typedef struct group_job {
+  const int *keys;
+  const int *const *columns;
+  const aggregate *aggregates;
+  size_t aggregate_count;
+  const size_t *rows;
+  size_t row_count;
+  size_t group_count;
+  int *group_keys;
+  int64_t *row_counts;
+  int64_t *accumulators; // aggregate_count per group
+} group_job;
+
+void run_group_job(void *jobs, size_t index) {
+  group_job *job = &((group_job *)jobs)[index];
+  size_t capacity = key_table_capacity(job->row_count);
+  key_slot *slots = calloc(capacity, sizeof(key_slot));
+  size_t groups = job->row_count ? job->row_count : 1;
+  job->group_keys = malloc(sizeof(int) * groups);
+  job->row_counts = malloc(sizeof(int64_t) * groups);
+  job->accumulators = malloc(sizeof(int64_t) * groups * job->aggregate_count);
+
+  for (size_t i = 0; i < job->row_count; i++) {
+    size_t row = job->rows[i];
+    key_slot *slot = find_key_slot(slots, capacity, job->keys[row]);
+    int is_new = slot->id == 0;
+    if (is_new) {
+      slot->key = job->keys[row];
+      slot->id = (uint32_t)++job->group_count;
+      job->group_keys[slot->id - 1] = slot->key;
+      job->row_counts[slot->id - 1] = 0;
+    }
+
+    size_t group = slot->id - 1;
+    job->row_counts[group]++;
+    int64_t *accumulators = job->accumulators + group * job->aggregate_count;
+    for (size_t j = 0; j < job->aggregate_count; j++) {
+      const aggregate *agg = &job->aggregates[j];
+      if (agg->kind == aggregate_kind_count)
+        continue;
+
+      int64_t val = job->columns[agg->column][row];
+      if (is_new ||
+          (agg->kind == aggregate_kind_min && val < accumulators[j]) ||
+          (agg->kind == aggregate_kind_max && val > accumulators[j])) {
+        accumulators[j] = val;
+      } else if (agg->kind == aggregate_kind_sum ||
+                 agg->kind == aggregate_kind_avg) {
+        accumulators[j] += val;
+      }
+    }
+  }
+  free(slots);
+}
+
+// Groups the rows by `keys` and computes the aggregates of every group.
+// `columns` holds the value columns the aggregates refer to, each with
+// `row_count` values. The caller frees the result with free_group_table.
+group_table *group_by(const int *keys, const int *const *columns,
+                      size_t row_count, const aggregate *aggregates,
+                      size_t aggregate_count, size_t thread_count) {
+  key_partitions parts =
+      partition_keys(keys, row_count, partition_bits(row_count));
+  group_job *jobs = calloc(parts.count, sizeof(group_job));
+  for (size_t i = 0; i < parts.count; i++) {
+    group_job job = {keys,
+                     columns,
+                     aggregates,
+                     aggregate_count,
+                     parts.rows + parts.offsets[i],
+                     parts.offsets[i + 1] - parts.offsets[i],
+                     0,
+                     NULL,
+                     NULL,
+                     NULL};
+    jobs[i] = job;
+  }
+  run_partitions(run_group_job, jobs, parts.count, thread_count);
+
+  group_table *table = malloc(sizeof(group_table));
+  table->group_count = 0;
+  table->aggregate_count = aggregate_count;
+  for (size_t i = 0; i < parts.count; i++)
+    table->group_count += jobs[i].group_count;
+  size_t groups = table->group_count ? table->group_count : 1;
+  table->keys = malloc(sizeof(int) * groups);
+  table->values = malloc(sizeof(aggregate_value) * groups * aggregate_count);
+
+  size_t group = 0;
+  for (size_t i = 0; i < parts.count; i++) {
+    group_job *job = &jobs[i];
+    for (size_t j = 0; j < job->group_count; j++, group++) {
+      table->keys[group] = job->group_keys[j];
+      aggregate_value *values = table->values + group * aggregate_count;
+      int64_t *accumulators = job->accumulators + j * aggregate_count;
+      for (size_t k = 0; k < aggregate_count; k++) {
+        if (aggregates[k].kind == aggregate_kind_count) {
+          values[k].integer = job->row_counts[j];
+        } else if (aggregates[k].kind == aggregate_kind_avg) {
+          values[k].average =
+              (double)accumulators[k] / (double)job->row_counts[j];
+        } else {
+          values[k].integer = accumulators[k];
+        }
+      }
+    }
+    free(job->group_keys);
+    free(job->row_counts);
+    free(job->accumulators);
+  }
+  free(jobs);
+  free_key_partitions(&parts);
+  return table;
+}
+
+void free_group_table(group_table *table) {
+  free(table->keys);
+  free(table->values);
+  free(table);
+}
+
+// Pairs of matching rows, in no particular order.
+typedef struct join_result {
+  size_t match_count;
+  size_t *build_rows;
+  size_t *probe_rows;
+} join_result;
+
+typedef struct join_job {
+  const int *build_keys;
+  const int *probe_keys;
+  const size_t *build_rows;
+  size_t build_count;
+  const size_t *probe_rows;
+  size_t probe_count;
+  join_result matches;
+  size_t capacity;
+} join_job;
+
+void run_join_job(void *jobs, size_t index) {
+  join_job *job = &((join_job *)jobs)[index];
+  if (job->build_count == 0 || job->probe_count == 0)
+    return;
+
+  // Every distinct build key gets a slot holding the first of its rows, and
+  // rows with the same key are chained through `next`.
+  size_t capacity = key_table_capacity(job->build_count);
+  key_slot *slots = calloc(capacity, sizeof(key_slot));
+  uint32_t *next = malloc(sizeof(uint32_t) * job->build_count);
+  for (size_t i = job->build_count; i-- > 0;) {
+    int key = job->build_keys[job->build_rows[i]];
+    key_slot *slot = find_key_slot(slots, capacity, key);
+    slot->key = key;
+    next[i] = slot->id;
+    slot->id = (uint32_t)i + 1;
+  }
+
+  for (size_t i = 0; i < job->probe_count; i++) {
+    size_t probe_row = job->probe_rows[i];
+    key_slot *slot =
+        find_key_slot(slots, capacity, job->probe_keys[probe_row]);
+    for (uint32_t id = slot->id; id != 0; id = next[id - 1]) {
+      if (job->matches.match_count == job->capacity) {
+        job->capacity = job->capacity ? job->capacity * 2 : 256;
+        job->matches.build_rows = realloc(job->matches.build_rows,
+                                          sizeof(size_t) * job->capacity);
+        job->matches.probe_rows = realloc(job->matches.probe_rows,
+                                          sizeof(size_t) * job->capacity);
+      }
+      job->matches.build_rows[job->matches.match_count] =
+          job->build_rows[id - 1];
+      job->matches.probe_rows[job->matches.match_count++] = probe_row;
+    }
+  }
+  free(next);
+  free(slots);
+}
+
+// Finds every pair of rows with equal keys. The hash table is built on
+// `build_keys`, which should be the smaller side. The caller frees the result
+// with free_join_result.
+join_result *hash_join(const int *build_keys, size_t build_count,
+                       const int *probe_keys, size_t probe_count,
+                       size_t thread_count) {
+  // Both sides are split the same way, so matching rows always end up in
+  // partitions with the same index.
+  size_t bits = partition_bits(build_count);
+  key_partitions build = partition_keys(build_keys, build_count, bits);
+  key_partitions probe = partition_keys(probe_keys, probe_count, bits);
+  join_job *jobs = calloc(build.count, sizeof(join_job));
+  for (size_t i = 0; i < build.count; i++) {
+    jobs[i].build_keys = build_keys;
+    jobs[i].probe_keys = probe_keys;
+    jobs[i].build_rows = build.rows + build.offsets[i];
+    jobs[i].build_count = build.offsets[i + 1] - build.offsets[i];
+    jobs[i].probe_rows = probe.rows + probe.offsets[i];
+    jobs[i].probe_count = probe.offsets[i + 1] - probe.offsets[i];
+  }
+  run_partitions(run_join_job, jobs, build.count, thread_count);
+
+  join_result *matches = calloc(1, sizeof(join_result));
+  for (size_t i = 0; i < build.count; i++)
+    matches->match_count += jobs[i].matches.match_count;
+  size_t count = matches->match_count ? matches->match_count : 1;
+  matches->build_rows = malloc(sizeof(size_t) * count);
+  matches->probe_rows = malloc(sizeof(size_t) * count);
+
+  size_t offset = 0;
+  for (size_t i = 0; i < build.count; i++) {
+    join_result *part = &jobs[i].matches;
+    if (part->match_count > 0) {
+      memcpy(matches->build_rows + offset, part->build_rows,
+             sizeof(size_t) * part->match_count);
+      memcpy(matches->probe_rows + offset, part->probe_rows,
+             sizeof(size_t) * part->match_count);
+      offset += part->match_count;
+    }
+    free(part->build_rows);
+    free(part->probe_rows);
+  }
+  free(jobs);
+  free_key_partitions(&build);
+  free_key_partitions(&probe);
+  return matches;
+}
+
+void free_join_result(join_result *matches) {
+  free(matches->build_rows);
+  free(matches->probe_rows);
+  free(matches);
+}
+
+// Sorting. Values sort in place with a pattern-defeating quicksort
+// by a script comparator or their natural order, and int columns with a
+// radix sort, optionally on several threads.
+
+#define SORT_INSERTION_THRESHOLD 24
+#define SORT_NINTHER_THRESHOLD 128
+#define SORT_PARTIAL_INSERTION_LIMIT 8
+#define PARALLEL_SORT_MIN_CHUNK (64 * 1024)
+
+// Without a comparator ints sort before strings and both by their natural
+// order. The first failed comparison is kept and makes every later one
+// return 0, so the sort winds down quickly.
+typedef struct value_order {
+  context *ctx;
+  function *comparator; // returns a negative, zero or positive integer
+  char *error_message;
+} value_order;
+
+int compare_values(value_order *order, value a, value b) {
+  if (order->error_message)
+    return 0;
+
+  if (!order->comparator) {
+    if (a.type == value_type_int && b.type == value_type_int)
+      return (a.int_value > b.int_value) - (a.int_value < b.int_value);
+    if (a.type == value_type_string && b.type == value_type_string)
+      return strcmp(a.string_value, b.string_value);
+    if ((a.type == value_type_int || a.type == value_type_string) &&
+        (b.type == value_type_int || b.type == value_type_string))
+      return a.type == value_type_int ? -1 : 1;
+    order->error_message = strdup("Cannot compare values of this type");
+    return 0;
+  }
+
+  value arguments[2] = {a, b};
+  result res = apply_function(order->ctx, order->comparator, arguments);
+  if (res.is_error) {
+    order->error_message = res.error_message;
+    return 0;
+  }
+
+  int comparison = res.result_value.int_value;
+  if (res.result_value.type != value_type_int) {
+    order->error_message = strdup("Comparator must return an integer");
+    comparison = 0;
+  }
+  free_result(res);
+  return comparison;
+}
+
+int value_less(value_order *order, value a, value b) {
+  return compare_values(order, a, b) < 0;
+}
+
+void swap_values(value *a, value *b) {
+  value swapped = *a;
+  *a = *b;
+  *b = swapped;
+}
+
+void sort2_values(value_order *order, value *a, value *b) {
+  if (value_less(order, *b, *a))
+    swap_values(a, b);
+}
+
+void sort3_values(value_order *order, value *a, value *b, value *c) {
+  sort2_values(order, a, b);
+  sort2_values(order, b, c);
+  sort2_values(order, a, b);
+}
+
+void insertion_sort_values(value_order *order, value *begin, value *end) {
+  for (value *current = begin + 1; current < end; current++) {
+    value moving = *current;
+    value *hole = current;
+    while (hole > begin && value_less(order, moving, hole[-1])) {
+      *hole = hole[-1];
+      hole--;
+    }
+    *hole = moving;
+  }
+}
+
+// Insertion sort that gives up once it moved a few elements. Returns 1 if the
+// range ended up sorted.
+int partial_insertion_sort_values(value_order *order, value *begin,
+                                  value *end) {
+  size_t moves = 0;
+  for (value *current = begin + 1; current < end; current++) {
+    value moving = *current;
+    value *hole = current;
+    while (hole > begin && value_less(order, moving, hole[-1])) {
+      *hole = hole[-1];
+      hole--;
+    }
+    *hole = moving;
+    moves += (size_t)(current - hole);
+    if (moves > SORT_PARTIAL_INSERTION_LIMIT && current + 1 < end)
+      return 0;
+  }
+  return 1;
+}
+
+// A value sifts down while one of its children belongs above it: the larger
+// child in a max-heap, the smaller one in a min-heap.
+void sift_down_values(value_order *order, value *heap, size_t count,
+                      size_t root, int is_min_heap) {
+  for (;;) {
+    size_t child = 2 * root + 1;
+    if (child >= count)
+      return;
+    if (child + 1 < count &&
+        (is_min_heap ? value_less(order, heap[child + 1], heap[child])
+                     : value_less(order, heap[child], heap[child + 1])))
+      child++;
+    if (is_min_heap ? !value_less(order, heap[child], heap[root])
+                    : !value_less(order, heap[root], heap[child]))
+      return;
+    swap_values(&heap[root], &heap[child]);
+    root = child;
+  }
+}
+
+void heap_sort_values(value_order *order, value *begin, value *end) {
+  size_t count = (size_t)(end - begin);
+  for (size_t i = count / 2; i-- > 0;)
+    sift_down_values(order, begin, count, i, 0);
+  for (size_t i = count; i-- > 1;) {
+    swap_values(&begin[0], &begin[i]);
+    sift_down_values(order, begin, i, 0, 0);
+  }
+}
+
+// Partitions around the pivot at `begin`, with the elements equal to it on
+// the right. Returns where the pivot ends up and sets `was_partitioned` when
+// no element had to move. The scans are bounded even though a consistent
+// comparator wouldn't need it, since scripts may supply any comparator.
+value *partition_right_values(value_order *order, value *begin, value *end,
+                              int *was_partitioned) {
+  value pivot = *begin;
+  value *first = begin;
+  value *last = end;
+  do
+    first++;
+  while (first < end && value_less(order, *first, pivot));
+  do
+    last--;
+  while (last > first && !value_less(order, *last, pivot));
+
+  *was_partitioned = first >= last;
+  while (first < last) {
+    swap_values(first, last);
+    do
+      first++;
+    while (first < end && value_less(order, *first, pivot));
+    do
+      last--;
+    while (last > begin && !value_less(order, *last, pivot));
+  }
+
+  value *pivot_position = first - 1;
+  *begin = *pivot_position;
+  *pivot_position = pivot;
+  return pivot_position;
+}
+
+// Partitions around the pivot at `begin` with the elements equal to it on
+// the left, for ranges with many duplicates.
+value *partition_left_values(value_order *order, value *begin, value *end) {
+  value pivot = *begin;
+  value *first = begin;
+  value *last = end;
+  do
+    last--;
+  while (last > begin && value_less(order, pivot, *last));
+  do
+    first++;
+  while (first < last && !value_less(order, pivot, *first));
+
+  while (first < last) {
+    swap_values(first, last);
+    do
+      last--;
+    while (last > begin && value_less(order, pivot, *last));
+    do
+      first++;
+    while (first < end && !value_less(order, pivot, *first));
+  }
+
+  *begin = *last;
+  *last = pivot;
+  return last;
+}
+
+// Quicksort that recognizes sorted and reverse sorted runs and many equal
+// elements in linear time, and switches to heap sort after too many
+// unbalanced partitions, so it never goes quadratic.
+void pdqsort_values(value_order *order, value *begin, value *end,
+                    int bad_allowed, int is_leftmost) {
+  for (;;) {
+    if (order->error_message)
+      return;
+
+    size_t size = (size_t)(end - begin);
+    if (size < SORT_INSERTION_THRESHOLD) {
+      insertion_sort_values(order, begin, end);
+      return;
+    }
+
+    // The pivot is the median of three, or of three medians of three for
+    // big ranges, and is moved to the front.
+    size_t half = size / 2;
+    if (size > SORT_NINTHER_THRESHOLD) {
+      sort3_values(order, begin, begin + half, end - 1);
+      sort3_values(order, begin + 1, begin + half - 1, end - 2);
+      sort3_values(order, begin + 2, begin + half + 1, end - 3);
+      sort3_values(order, begin + half - 1, begin + half, begin + half + 1);
+      swap_values(begin, begin + half);
+    } else {
+      sort3_values(order, begin + half, begin, end - 1);
+    }
+
+    // The element left of the range is the pivot of an earlier partition and
+    // nothing here is smaller. A pivot equal to it is the smallest, so the
+    // elements equal to it go left and are done.
+    if (!is_leftmost && !value_less(order, begin[-1], *begin)) {
+      begin = partition_left_values(order, begin, end) + 1;
+      continue;
+    }
+
+    int was_partitioned;
+    value *pivot = partition_right_values(order, begin, end, &was_partitioned);
+    size_t left_size = (size_t)(pivot - begin);
+    size_t right_size = (size_t)(end - pivot - 1);
+    if (left_size < size / 8 || right_size < size / 8) {
+      if (--bad_allowed == 0) {
+        heap_sort_values(order, begin, end);
+        return;
+      }
+
+      // Swap a few elements around to break up whatever pattern keeps
+      // giving bad pivots.
+      if (left_size >= SORT_INSERTION_THRESHOLD) {
+        swap_values(begin, begin + left_size / 4);
+        swap_values(pivot - 1, pivot - left_size / 4);
+      }
+      if (right_size >= SORT_INSERTION_THRESHOLD) {
+        swap_values(pivot + 1, pivot + 1 + right_size / 4);
+        swap_values(end - 1, end - right_size / 4);
+      }
+    } else if (was_partitioned &&
+               partial_insertion_sort_values(order, begin, pivot) &&
+               partial_insertion_sort_values(order, pivot + 1, end)) {
+      return;
+    }
+
+    pdqsort_values(order, begin, pivot, bad_allowed, is_leftmost);
+    begin = pivot + 1;
+    is_leftmost = 0;
+  }
+}
+
+// Sorts `values` in place, which isn't stable. `comparator` may be NULL, or a
+// function of two values that returns a negative, zero or positive integer
+// like strcmp. When a comparison fails the error is returned and the values
+// are left in some order.
+result sort_values(context *ctx, value *values, size_t count,
+                   function *comparator) {
+  if (comparator && comparator->parameter_count != 2)
+    return create_error_result("Comparator must take two arguments");
+
+  value_order order = {ctx, comparator, NULL};
+  int bad_allowed = 1;
+  for (size_t n = count; n > 1; n /= 2)
+    bad_allowed++;
+  if (count > 1)
+    pdqsort_values(&order, values, values + count, bad_allowed, 1);
+
+  if (order.error_message) {
+    result res = create_error_result(order.error_message);
+    free(order.error_message);
+    return res;
+  }
+  return create_success_result(create_int_value(0));
+}
+
+// Copies the `k` largest values, largest first, to `top`, which needs room
+// for `k` values the caller frees afterwards. A bounded min-heap of the
+// largest values seen so far takes one pass and memory for `k` values only.
+// Returns how many values were copied, or the error of a failed comparison.
+result top_k_values(context *ctx, const value *values, size_t count, size_t k,
+                    function *comparator, value *top) {
+  if (comparator && comparator->parameter_count != 2)
+    return create_error_result("Comparator must take two arguments");
+
+  value_order order = {ctx, comparator, NULL};
+  size_t length = 0;
+  for (size_t i = 0; i < count && k > 0 && !order.error_message; i++) {
+    if (length < k) {
+      top[length++] = values[i];
+      if (length == k) {
+        for (size_t j = k / 2; j-- > 0;)
+          sift_down_values(&order, top, k, j, 1);
+      }
+    } else if (value_less(&order, top[0], values[i])) {
+      top[0] = values[i];
+      sift_down_values(&order, top, k, 0, 1);
+    }
+  }
+
+  // Sorts the heap from largest to smallest, or the values when there were
+  // fewer than `k`.
+  if (length < k) {
+    for (size_t j = length / 2; j-- > 0;)
+      sift_down_values(&order, top, length, j, 1);
+  }
+  for (size_t i = length; i-- > 1;) {
+    swap_values(&top[0], &top[i]);
+    sift_down_values(&order, top, i, 0, 1);
+  }
+
+  if (order.error_message) {
+    result res = create_error_result(order.error_message);
+    free(order.error_message);
+    return res;
+  }
+  for (size_t i = 0; i < length; i++)
+    top[i] = copy_value(top[i]);
+  return create_success_result(create_int_value((int)length));
+}
+
+// LSD radix sort, a byte per pass. Flipping the sign bit makes negative keys
+// sort first. Passes whose byte is the same in every key are skipped, so
+// keys from a small range take fewer passes.
+void radix_sort_ints(int *keys, size_t count) {
+  if (count < 2)
+    return;
+
+  size_t (*histograms)[256] = calloc(4, sizeof(*histograms));
+  for (size_t i = 0; i < count; i++) {
+    uint32_t key = (uint32_t)keys[i] ^ 0x80000000u;
+    for (size_t pass = 0; pass < 4; pass++)
+      histograms[pass][(key >> (pass * 8)) & 0xff]++;
+  }
+
+  int *scratch = malloc(sizeof(int) * count);
+  int *from = keys;
+  int *to = scratch;
+  for (size_t pass = 0; pass < 4; pass++) {
+    size_t shift = pass * 8;
+    size_t *histogram = histograms[pass];
+    uint32_t first = ((uint32_t)from[0] ^ 0x80000000u) >> shift & 0xff;
+    if (histogram[first] == count)
+      continue;
+
+    size_t offsets[256];
+    size_t offset = 0;
+    for (size_t digit = 0; digit < 256; digit++) {
+      offsets[digit] = offset;
+      offset += histogram[digit];
+    }
+    for (size_t i = 0; i < count; i++) {
+      uint32_t key = (uint32_t)from[i] ^ 0x80000000u;
+      to[offsets[(key >> shift) & 0xff]++] = from[i];
+    }
+    int *swapped = from;
+    from = to;
+    to = swapped;
+  }
+
+  if (from != keys)
+    memcpy(keys, from, sizeof(int) * count);
+  free(scratch);
+  free(histograms);
+}
+
+// Adjacent sorted runs, from[bounds[i]] up to from[bounds[i + 1]].
+typedef struct sort_runs {
+  int *from;
+  int *to;
+  const size_t *bounds;
+  size_t run_count;
+} sort_runs;
+
+void run_radix_sort_job(void *jobs, size_t index) {
+  sort_runs *runs = jobs;
+  radix_sort_ints(runs->from + runs->bounds[index],
+                  runs->bounds[index + 1] - runs->bounds[index]);
+}
+
+// Merges runs 2 * index and 2 * index + 1 into `to`; a last run without a
+// partner is copied.
+void run_merge_job(void *jobs, size_t index) {
+  sort_runs *runs = jobs;
+  size_t left = runs->bounds[2 * index];
+  size_t middle = runs->bounds[2 * index + 1];
+  size_t right = 2 * index + 2 <= runs->run_count
+                     ? runs->bounds[2 * index + 2]
+                     : middle;
+  size_t i = left, j = middle, out = left;
+  while (i < middle && j < right)
+    runs->to[out++] = runs->from[j] < runs->from[i] ? runs->from[j++]
+                                                    : runs->from[i++];
+  memcpy(runs->to + out, runs->from + i, sizeof(int) * (middle - i));
+  out += middle - i;
+  memcpy(runs->to + out, runs->from + j, sizeof(int) * (right - j));
+}
+
+// Radix sorts a chunk per thread, then merges the sorted runs pairwise, all
+// merges of a round at once, until one run is left.
+void parallel_sort_ints(int *keys, size_t count, size_t thread_count) {
+  size_t run_count = count / PARALLEL_SORT_MIN_CHUNK;
+  if (run_count > thread_count)
+    run_count = thread_count;
+  if (run_count <= 1) {
+    radix_sort_ints(keys, count);
+    return;
+  }
+
+  size_t *bounds = malloc(sizeof(size_t) * (run_count + 1));
+  for (size_t i = 0; i <= run_count; i++)
+    bounds[i] = count * i / run_count;
+  int *scratch = malloc(sizeof(int) * count);
+  sort_runs runs = {keys, scratch, bounds, run_count};
+  run_partitions(run_radix_sort_job, &runs, run_count, thread_count);
+
+  while (runs.run_count > 1) {
+    size_t merge_count = (runs.run_count + 1) / 2;
+    run_partitions(run_merge_job, &runs, merge_count, thread_count);
+    for (size_t i = 0; i < merge_count; i++)
+      bounds[i + 1] = bounds[2 * i + 2 <= runs.run_count ? 2 * i + 2
+                                                         : runs.run_count];
+    runs.run_count = merge_count;
+    int *swapped = runs.from;
+    runs.from = runs.to;
+    runs.to = swapped;
+  }
+
+  if (runs.from != keys)
+    memcpy(keys, runs.from, sizeof(int) * count);
+  free(scratch);
+  free(bounds);
+}
+
+// Writes the `k` largest keys, largest first, to `top` and returns how many
+// were written, which is fewer than `k` for fewer keys.
+size_t top_k_ints(const int *keys, size_t count, size_t k, int *top) {
+  size_t length = 0;
+  for (size_t i = 0; i < count && k > 0; i++) {
+    if (length < k) {
+      // Sifts the new key up the min-heap.
+      size_t child = length++;
+      top[child] = keys[i];
+      while (child > 0 && top[child] < top[(child - 1) / 2]) {
+        int parent = top[(child - 1) / 2];
+        top[(child - 1) / 2] = top[child];
+        top[child] = parent;
+        child = (child - 1) / 2;
+      }
+      continue;
+    } else if (keys[i] <= top[0]) {
+      continue;
+    }
+
+    top[0] = keys[i];
+    for (size_t root = 0;;) {
+      size_t child = 2 * root + 1;
+      if (child >= k)
+        break;
+      if (child + 1 < k && top[child + 1] < top[child])
+        child++;
+      if (top[root] <= top[child])
+        break;
+      int swapped = top[root];
+      top[root] = top[child];
+      top[child] = swapped;
+      root = child;
+    }
+  }
+
+  radix_sort_ints(top, length);
+  for (size_t i = 0; i < length / 2; i++) {
+    int swapped = top[i];
+    top[i] = top[length - 1 - i];
+    top[length - 1 - i] = swapped;
+  }
+  return length;
+}
+
+// Vector builtins on top of the sorting, aggregation and join functions
+// above. Vectors of integers take the radix sort and hash table paths; other
+// items are compared like compare_values does.
+
+int is_vector_builtin(const char *name) {
+  return strcmp(name, "vector") == 0 || strcmp(name, "vector-length") == 0 ||
+         strcmp(name, "vector-ref") == 0 || strcmp(name, "sort") == 0 ||
+         strcmp(name, "sort!") == 0 || strcmp(name, "top-k") == 0 ||
+         strcmp(name, "group-by") == 0 || strcmp(name, "hash-join") == 0;
+}
+
+// Copies the items to an array the caller frees, or returns NULL if one of
+// them isn't an integer.
+int *vector_ints(const vector *v) {
+  int *ints = malloc(sizeof(int) * (v->length + 1));
+  for (size_t i = 0; i < v->length; i++) {
+    if (v->items[i].type != value_type_int) {
+      free(ints);
+      return NULL;
+    }
+    ints[i] = v->items[i].int_value;
+  }
+  return ints;
+}
+
+value create_int_vector_value(const int *ints, size_t length) {
+  value *items = allocate_vector_items(length);
+  for (size_t i = 0; i < length; i++) {
+    items[i] = create_int_value(ints[i]);
+  }
+  return create_vector_value(items, length);
+}
+
+// Integers in their natural order are radix sorted, on several threads when
+// there are many of them; anything else goes through sort_values.
+result sort_vector(context *ctx, vector *v, function *comparator) {
+  int *ints = comparator ? NULL : vector_ints(v);
+  if (!ints)
+    return sort_values(ctx, v->items, v->length, comparator);
+
+  parallel_sort_ints(ints, v->length, online_cpu_count());
+  for (size_t i = 0; i < v->length; i++) {
+    v->items[i].int_value = ints[i];
+  }
+  free(ints);
+  return create_success_result(create_int_value(0));
+}
+
+result eval_sort(context *ctx, const char *name, value *args, size_t count) {
+  if (count < 1 || count > 2 || args[0].type != value_type_vector ||
+      (count == 2 && args[1].type != value_type_function))
+    return create_error_result("sort expects a vector and optionally a "
+                               "comparator");
+
+  vector *v = args[0].vector_value;
+  function *comparator = count == 2 ? args[1].function_value : NULL;
+  if (strcmp(name, "sort!") == 0) {
+    if (v->is_immortal)
+      return create_error_result("Cannot modify a frozen vector");
+
+    result res = sort_vector(ctx, v, comparator);
+    if (res.is_error)
+      return res;
+    free_result(res);
+    return create_success_result(copy_value(args[0]));
+  }
+
+  value *items = allocate_vector_items(v->length);
+  for (size_t i = 0; i < v->length; i++) {
+    items[i] = copy_value(v->items[i]);
+  }
+  value sorted = create_vector_value(items, v->length);
+  result res = sort_vector(ctx, sorted.vector_value, comparator);
+  if (res.is_error) {
+    free_value(sorted);
+    return res;
+  }
+  free_result(res);
+  return create_success_result(sorted);
+}
+
+// (top-k v k [comparator]): the `k` largest items, largest first.
+result eval_top_k(context *ctx, value *args, size_t count) {
+  if (count < 2 || count > 3 || args[0].type != value_type_vector ||
+      args[1].type != value_type_int || args[1].int_value < 0 ||
+      (count == 3 && args[2].type != value_type_function))
+    return create_error_result("top-k expects a vector, a count and "
+                               "optionally a comparator");
+
+  vector *v = args[0].vector_value;
+  size_t k = (size_t)args[1].int_value;
+  if (k > v->length)
+    k = v->length;
+
+  function *comparator = count == 3 ? args[2].function_value : NULL;
+  int *ints = comparator ? NULL : vector_ints(v);
+  if (ints) {
+    int *top = malloc(sizeof(int) * (k + 1));
+    top_k_ints(ints, v->length, k, top);
+    value val = create_int_vector_value(top, k);
+    free(top);
+    free(ints);
+    return create_success_result(val);
+  }
+
+  value *top = allocate_vector_items(k);
+  result res = top_k_values(ctx, v->items, v->length, k, comparator, top);
+  if (res.is_error) {
+    heap_free(heap_kind_vector, top, sizeof(value) * k);
+    return res;
+  }
+  free_result(res);
+  return create_success_result(create_vector_value(top, k));
+}
+
+result eval_vector_operation(context *ctx, const char *name, value *args,
+                             size_t count) {
+  if (strcmp(name, "vector") == 0) {
+    value *items = allocate_vector_items(count);
+    for (size_t i = 0; i < count; i++) {
+      items[i] = copy_value(args[i]);
+    }
+    return create_success_result(create_vector_value(items, count));
+  } else if (strcmp(name, "sort") == 0 || strcmp(name, "sort!") == 0) {
+    return eval_sort(ctx, name, args, count);
+  } else if (strcmp(name, "top-k") == 0) {
+    return eval_top_k(ctx, args, count);
+  }
+
+  if (count == 0 || args[0].type != value_type_vector)
+    return create_error_result("Expected a vector argument");
+  vector *v = args[0].vector_value;
+
+  if (strcmp(name, "vector-length") == 0) {
+    if (count != 1)
+      return create_error_result("vector-length expects a vector");
+    return create_success_result(create_int_value((int)v->length));
+  }
+
+  if (count != 2 || args[1].type != value_type_int)
+    return create_error_result("vector-ref expects a vector and an index");
+  if (args[1].int_value < 0 || (size_t)args[1].int_value >= v->length)
+    return create_error_result("Index out of range");
+  return create_success_result(copy_value(v->items[args[1].int_value]));
+}
+
+// Reads the columns of group-by and hash-join, which are all vectors of
+// integers of the same length, and the optional thread count. On success the
+// caller frees every column.
+const char *read_int_columns(value *args, size_t column_count,
+                             const value *threads, int **columns,
+                             size_t *row_count, size_t *thread_count) {
+  if (threads && (threads->type != value_type_int || threads->int_value < 1))
+    return ":threads expects a positive integer";
+  *thread_count = threads ? (size_t)threads->int_value : online_cpu_count();
+
+  for (size_t i = 0; i < column_count; i++) {
+    columns[i] = NULL;
+    if (args[i].type == value_type_vector &&
+        (i == 0 || args[i].vector_value->length == *row_count))
+      columns[i] = vector_ints(args[i].vector_value);
+    if (!columns[i]) {
+      for (size_t j = 0; j < i; j++) {
+        free(columns[j]);
+      }
+      return "Expected vectors of integers of the same length";
+    }
+    *row_count = args[i].vector_value->length;
+  }
+  return NULL;
+}
+
+value group_table_rows(const group_table *table, const aggregate *aggregates) {
+  value *rows = allocate_vector_items(table->group_count);
+  size_t width = table->aggregate_count + 1;
+  for (size_t i = 0; i < table->group_count; i++) {
+    const aggregate_value *values = table->values + i * (width - 1);
+    value *items = allocate_vector_items(width);
+    items[0] = create_int_value(table->keys[i]);
+    for (size_t j = 1; j < width; j++) {
+      items[j] = create_int_value(
+          aggregates[j - 1].kind == aggregate_kind_avg
+              ? (int)values[j - 1].average
+              : (int)values[j - 1].integer);
+    }
+    rows[i] = create_vector_value(items, width);
+  }
+  return create_vector_value(rows, table->group_count);
+}
+
+// (group-by keys :count :sum column :min column :max column :avg column
+// [:threads n]) returns a vector of #(key aggregate...) rows, one per distinct
+// key in no particular order. Averages are rounded toward zero. The keywords
+// aren't evaluated.
+result eval_group_by(context *ctx, environment *env, ast_node *node) {
+  static const char *keywords[] = {":count", ":sum", ":min", ":max", ":avg"};
+  size_t length = node->list.length;
+  ast_node **items = malloc(sizeof(ast_node *) * length);
+  aggregate *aggregates = malloc(sizeof(aggregate) * length);
+  size_t column_count = 0;
+  size_t aggregate_count = 0;
+  ast_node *threads = NULL;
+  const char *error = length < 3 ? "group-by expects a key column and "
+                                   "aggregates"
+                                 : NULL;
+  if (!error)
+    items[column_count++] = node->list.items[1];
+
+  for (size_t i = 2; i < length && !error; i++) {
+    ast_node *item = node->list.items[i];
+    const char *keyword =
+        item->type == node_type_symbol ? item->symbol_value : "";
+    size_t kind = 0;
+    while (kind < 5 && strcmp(keyword, keywords[kind]) != 0)
+      kind++;
+
+    if (strcmp(keyword, ":threads") == 0 && !threads && i + 1 < length) {
+      threads = node->list.items[++i];
+    } else if (kind == aggregate_kind_count) {
+      aggregate agg = {aggregate_kind_count, 0};
+      aggregates[aggregate_count++] = agg;
+    } else if (kind < 5 && i + 1 < length) {
+      aggregate agg = {(aggregate_kind)kind, column_count - 1};
+      aggregates[aggregate_count++] = agg;
+      items[column_count++] = node->list.items[++i];
+    } else {
+      error = "group-by expects aggregates like :count or :sum column";
+    }
+  }
+  if (error) {
+    free(items);
+    free(aggregates);
+    return create_error_result(error);
+  }
+
+  size_t arg_count = column_count;
+  if (threads)
+    items[arg_count++] = threads;
+  value *args = heap_allocate(heap_kind_frame, sizeof(value) * arg_count);
+  result res = eval_arguments(ctx, env, items, args, arg_count);
+  free(items);
+  if (res.is_error) {
+    heap_free(heap_kind_frame, args, sizeof(value) * arg_count);
+    free(aggregates);
+    return res;
+  }
+
+  int **columns = malloc(sizeof(int *) * column_count);
+  size_t row_count = 0;
+  size_t thread_count;
+  error = read_int_columns(args, column_count, threads ? &args[arg_count - 1]
+                                                       : NULL,
+                           columns, &row_count, &thread_count);
+  if (!error) {
+    group_table *table =
+        group_by(columns[0], (const int *const *)columns + 1, row_count,
+                 aggregates, aggregate_count, thread_count);
+    size_t value_count = table->group_count * aggregate_count;
+    for (size_t i = 0; i < value_count && !error; i++) {
+      int64_t integer = table->values[i].integer;
+      if (aggregates[i % aggregate_count].kind != aggregate_kind_avg &&
+          (integer < INT_MIN || integer > INT_MAX))
+        error = "Aggregate doesn't fit an integer";
+    }
+    if (!error) {
+      free_result(res);
+      res = create_success_result(group_table_rows(table, aggregates));
+    }
+    free_group_table(table);
+    for (size_t i = 0; i < column_count; i++) {
+      free(columns[i]);
+    }
+  }
+  if (error) {
+    free_result(res);
+    res = create_error_result(error);
+  }
+
+  for (size_t i = 0; i < arg_count; i++) {
+    free_value(args[i]);
+  }
+  heap_free(heap_kind_frame, args, sizeof(value) * arg_count);
+  free(columns);
+  free(aggregates);
+  return res;
+}
+
+// (hash-join build-keys probe-keys [:threads n]) returns a vector of
+// #(build-index probe-index) pairs, one per pair of rows with equal keys, in no
+// particular order. The hash table is built on the first column, which should
+// be the smaller one.
+result eval_hash_join(context *ctx, environment *env, ast_node *node) {
+  size_t arg_count = 2;
+  if (node->list.length == 5 &&
+      node->list.items[3]->type == node_type_symbol &&
+      strcmp(node->list.items[3]->symbol_value, ":threads") == 0) {
+    arg_count = 3;
+  } else if (node->list.length != 3) {
+    return create_error_result("hash-join expects two key columns and "
+                               "optionally :threads n");
+  }
+
+  value args[3];
+  ast_node *items[3] = {node->list.items[1], node->list.items[2],
+                        arg_count == 3 ? node->list.items[4] : NULL};
+  result res = eval_arguments(ctx, env, items, args, arg_count);
+  if (res.is_error)
+    return res;
+
+  int *columns[2];
+  size_t row_counts[2] = {0, 0};
+  size_t thread_count;
+  const value *threads = arg_count == 3 ? &args[2] : NULL;
+  const char *error = read_int_columns(args, 1, threads, columns,
+                                       &row_counts[0], &thread_count);
+  if (!error) {
+    error = read_int_columns(args + 1, 1, threads, columns + 1,
+                             &row_counts[1], &thread_count);
+    if (error)
+      free(columns[0]);
+  }
+
+  if (error) {
+    free_result(res);
+    res = create_error_result(error);
+  } else {
+    join_result *matches = hash_join(columns[0], row_counts[0], columns[1],
+                                     row_counts[1], thread_count);
+    value *pairs = allocate_vector_items(matches->match_count);
+    for (size_t i = 0; i < matches->match_count; i++) {
+      int pair[2] = {(int)matches->build_rows[i], (int)matches->probe_rows[i]};
+      pairs[i] = create_int_vector_value(pair, 2);
+    }
+    free_result(res);
+    res = create_success_result(
+        create_vector_value(pairs, matches->match_count));
+    free_join_result(matches);
+    free(columns[0]);
+    free(columns[1]);
+  }
+
+  for (size_t i = 0; i < arg_count; i++) {
+    free_value(args[i]);
+  }
+  return res;
+}
+
+result eval_vector_builtin(context *ctx, environment *env, ast_node *node) {
+  const char *name = node->list.items[0]->symbol_value;
+  if (strcmp(name, "group-by") == 0) {
+    return eval_group_by(ctx, env, node);
+  } else if (strcmp(name, "hash-join") == 0) {
+    return eval_hash_join(ctx, env, node);
+  }
+
+  size_t count = node->list.length - 1;
+  value *args = heap_allocate(heap_kind_frame, sizeof(value) * count);
+  result res = eval_arguments(ctx, env, node->list.items + 1, args, count);
+  if (!res.is_error) {
+    free_result(res);
+    res = eval_vector_operation(ctx, name, args, count);
+    for (size_t i = 0; i < count; i++) {
+      free_value(args[i]);
+    }
+  }
+  heap_free(heap_kind_frame, args, sizeof(value) * count);
+  return res;
+}
+
+int is_pure_function(const context *ctx, function *fn, pointer_set *visiting);
+
+// Whether evaluating the node only depends on its inputs and the globals.
+// Functions being analyzed further up are assumed to be pure. A call through
+// a parameter can't be analyzed, since any function may be passed in.
+int is_pure_node(const context *ctx, ast_node *node, char **parameters,
+                 size_t parameter_count, pointer_set *visiting) {
+  if (node->type != node_type_list)
+    return 1;
+  if (node->list.length == 0 || node->list.items[0]->type != node_type_symbol)
+    return 0;
+
+  for (size_t i = 1; i < node->list.length; i++) {
+    if (!is_pure_node(ctx, node->list.items[i], parameters, parameter_count,
+                      visiting))
+      return 0;
+  }
+
+  const char *name = node->list.items[0]->symbol_value;
+  const builtin_info *builtin = find_builtin(name);
+  if (builtin)
+    return builtin->is_pure;
+
+  for (size_t i = 0; i < parameter_count; i++) {
+    if (strcmp(parameters[i], name) == 0)
+      return 0;
+  }
+
+  value *callee = find_global(ctx, name);
+  if (!callee || callee->type != value_type_function)
+    return 0;
+  return is_pure_function(ctx, callee->function_value, visiting);
+}
+
+int is_pure_function(const context *ctx, function *fn, pointer_set *visiting) {
+  if (!add_pointer(visiting, fn))
+    return 1;
+  for (size_t i = 0; i < fn->body_length; i++) {
+    if (!is_pure_node(ctx, fn->body[i], fn->parameters, fn->parameter_count,
+                      visiting))
+      return 0;
+  }
+  return 1;
+}
+
+// A parsed form together with what's needed to cache its results.
+typedef struct prepared_form {
+  ast_node *form; // borrowed
+  uint64_t hash;
+  int is_pure;
+  uint64_t analyzed_epoch; // definition epoch `is_pure` was computed for
+  const context *analyzed_context;
+  char **analyzed_parameters; // calls through these make the form impure
+} prepared_form;
+
+prepared_form prepare_form(ast_node *form) {
+  prepared_form prepared = {form, hash_ast_node(form), 0, 0, NULL, NULL};
+  return prepared;
+}
+
+#define RESULT_CACHE_SHARDS 16
+#define RESULT_CACHE_PROBES 8
+
+typedef struct result_cache_entry {
+  int is_used;
+  uint64_t form_hash;
+  uint64_t input_hash;
+  uint64_t epoch;
+  const context *ctx;
+  uint64_t last_used;
+  value *inputs; // held, so inputs compared by identity can't be reused
+  char **parameters; // the inputs' names, in order
+  size_t input_count;
+  value val;
+} result_cache_entry;
+
+typedef struct result_cache_shard {
+  pthread_mutex_t lock;
+  result_cache_entry *entries;
+  uint64_t clock;
+} result_cache_shard;
+
+// Results of pure evaluations keyed by the form's structural hash, the inputs
+// along with the parameters they're bound to, and the definition epoch of
+// the context, so redefining anything makes older entries unreachable until
+// they're evicted. Strings and bytevectors are compared by content, other
+// inputs by identity. Entries are spread over independently locked shards; a
+// shard holds a fixed number of entries and a new one replaces the least
+// recently used within its probe window.
+typedef struct result_cache {
+  result_cache_shard shards[RESULT_CACHE_SHARDS];
+  size_t shard_capacity; // power of two
+  atomic_size_t hits;
+  atomic_size_t misses;
+} result_cache;
+
+result_cache *create_result_cache(size_t max_entries) {
+  result_cache *cache = calloc(1, sizeof(result_cache));
+  cache->shard_capacity = RESULT_CACHE_PROBES;
+  while (cache->shard_capacity * RESULT_CACHE_SHARDS < max_entries)
+    cache->shard_capacity *= 2;
+
+  for (size_t i = 0; i < RESULT_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&cache->shards[i].lock, NULL);
+    cache->shards[i].entries =
+        calloc(cache->shard_capacity, sizeof(result_cache_entry));
+  }
+  return cache;
+}
+
+void clear_result_cache_entry(result_cache_entry *entry) {
+  for (size_t i = 0; i < entry->input_count; i++) {
+    free_value(entry->inputs[i]);
+    free(entry->parameters[i]);
+  }
+  free(entry->inputs);
+  free(entry->parameters);
+  free_value(entry->val);
+  entry->is_used = 0;
+}
+
+void free_result_cache(result_cache *cache) {
+  for (size_t i = 0; i < RESULT_CACHE_SHARDS; i++) {
+    for (size_t j = 0; j < cache->shard_capacity; j++) {
+      if (cache->shards[i].entries[j].is_used)
+        clear_result_cache_entry(&cache->shards[i].entries[j]);
+    }
+    free(cache->shards[i].entries);
+    pthread_mutex_destroy(&cache->shards[i].lock);
+  }
+  free(cache);
+}
+
+// Returns 0 when an input can't be part of a cache key. The same inputs
+// bound to other parameters hash differently.
+int hash_inputs(char **parameters, value *inputs, size_t count,
+                uint64_t *hash) {
+  *hash = mix_hash(14695981039346656037ULL, count);
+  for (size_t i = 0; i < count; i++) {
+    value val = inputs[i];
+    *hash = mix_hash(*hash, hash_string(parameters[i]));
+    *hash = mix_hash(*hash, val.type);
+    if (val.type == value_type_int) {
+      *hash = mix_hash(*hash, (uint64_t)val.int_value);
+    } else if (val.type == value_type_string) {
+      *hash = mix_hash(*hash, hash_string(val.string_value));
+    } else if (val.type == value_type_function) {
+      *hash = mix_hash(*hash, (uint64_t)(uintptr_t)val.function_value);
+    } else if (val.type == value_type_handle) {
+      *hash = mix_hash(*hash, (uint64_t)(uintptr_t)val.handle_value);
+    } else if (val.type == value_type_bytevector) {
+      *hash = mix_hash(*hash, hash_bytes(val.bytevector_value->data,
+                                         val.bytevector_value->length));
+    } else if (val.type == value_type_matcher) {
+      *hash = mix_hash(*hash, (uint64_t)(uintptr_t)val.matcher_value);
+    } else {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Functions passed in may end up being called, so they have to be pure too.
+int are_pure_inputs(const context *ctx, const value *inputs, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (inputs[i].type != value_type_function)
+      continue;
+
+    pointer_set visiting = {NULL, 0, 0};
+    int is_pure = is_pure_function(ctx, inputs[i].function_value, &visiting);
+    free(visiting.slots);
+    if (!is_pure)
+      return 0;
+  }
+  return 1;
+}
+
+// Only called for inputs hash_inputs accepted.
+int cache_inputs_equal(char **a_parameters, const value *a,
+                       char **b_parameters, const value *b, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (a[i].type != b[i].type ||
+        strcmp(a_parameters[i], b_parameters[i]) != 0)
+      return 0;
+    if (a[i].type == value_type_int) {
+      if (a[i].int_value != b[i].int_value)
+        return 0;
+    } else if (a[i].type == value_type_string) {
+      if (strcmp(a[i].string_value, b[i].string_value) != 0)
+        return 0;
+    } else if (a[i].type == value_type_bytevector) {
+      const bytevector *x = a[i].bytevector_value;
+      const bytevector *y = b[i].bytevector_value;
+      if (x->length != y->length ||
+          (x->length > 0 && memcmp(x->data, y->data, x->length) != 0))
+        return 0;
+    } else if (a[i].type == value_type_function) {
+      if (a[i].function_value != b[i].function_value)
+        return 0;
+    } else if (a[i].type == value_type_handle) {
+      if (a[i].handle_value != b[i].handle_value)
+        return 0;
+    } else if (a[i].matcher_value != b[i].matcher_value) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int result_cache_matches(result_cache_entry *entry, uint64_t form_hash,
+                         uint64_t input_hash, char **parameters,
+                         const value *inputs, size_t input_count,
+                         const context *ctx, uint64_t epoch) {
+  return entry->is_used && entry->form_hash == form_hash &&
+         entry->input_hash == input_hash && entry->ctx == ctx &&
+         entry->epoch == epoch && entry->input_count == input_count &&
+         cache_inputs_equal(entry->parameters, entry->inputs, parameters,
+                            inputs, input_count);
+}
+
+// The context whose definitions an evaluation in `ctx` sees. Overlays that
+// didn't define anything see exactly their prelude's, so they share its
+// cache entries.
+const context *definitions_owner(const context *ctx) {
+  while (ctx->definition_epoch == 0 && ctx->prelude)
+    ctx = ctx->prelude;
+  return ctx;
+}
+
+// Evaluates the form with `parameters` bound to `arguments`, answering from
+// the cache when the form is pure and was evaluated with the same inputs
+// before. `cache` may be shared between threads, but must not outlive the
+// contexts it's used with.
+result eval_cached(context *ctx, result_cache *cache, prepared_form *prepared,
+                   char **parameters, value *arguments, size_t count) {
+  environment frame = {parameters, arguments, count};
+  const context *owner = definitions_owner(ctx);
+  if (prepared->analyzed_context != ctx ||
+      prepared->analyzed_epoch != ctx->definition_epoch ||
+      prepared->analyzed_parameters != parameters) {
+    pointer_set visiting = {NULL, 0, 0};
+    prepared->is_pure =
+        is_pure_node(ctx, prepared->form, parameters, count, &visiting);
+    prepared->analyzed_epoch = ctx->definition_epoch;
+    prepared->analyzed_context = ctx;
+    prepared->analyzed_parameters = parameters;
+    free(visiting.slots);
+  }
+
+  uint64_t input_hash;
+  if (!prepared->is_pure ||
+      !hash_inputs(parameters, arguments, count, &input_hash) ||
+      !are_pure_inputs(ctx, arguments, count))
+    return eval_ast_node(ctx, &frame, prepared->form);
+
+  uint64_t key = mix_hash(prepared->hash, input_hash);
+  result_cache_shard *shard = &cache->shards[key % RESULT_CACHE_SHARDS];
+  size_t mask = cache->shard_capacity - 1;
+  size_t home = (key / RESULT_CACHE_SHARDS) & mask;
+
+  pthread_mutex_lock(&shard->lock);
+  for (size_t i = 0; i < RESULT_CACHE_PROBES; i++) {
+    result_cache_entry *entry = &shard->entries[(home + i) & mask];
+    if (result_cache_matches(entry, prepared->hash, input_hash, parameters,
+                             arguments, count, owner,
+                             owner->definition_epoch)) {
+      entry->last_used = ++shard->clock;
+      value val = copy_value(entry->val);
+      pthread_mutex_unlock(&shard->lock);
+      atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+      return create_success_result(val);
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+  result res = eval_ast_node(ctx, &frame, prepared->form);
+  if (res.is_error)
+    return res;
+
+  pthread_mutex_lock(&shard->lock);
+  result_cache_entry *victim = &shard->entries[home];
+  for (size_t i = 0; i < RESULT_CACHE_PROBES && victim->is_used; i++) {
+    result_cache_entry *entry = &shard->entries[(home + i) & mask];
+    if (!entry->is_used || entry->last_used < victim->last_used)
+      victim = entry;
+  }
+  if (victim->is_used)
+    clear_result_cache_entry(victim);
+  victim->is_used = 1;
+  victim->form_hash = prepared->hash;
+  victim->input_hash = input_hash;
+  victim->inputs = malloc(sizeof(value) * (count + 1));
+  victim->parameters = malloc(sizeof(char *) * (count + 1));
+  for (size_t i = 0; i < count; i++) {
+    victim->inputs[i] = copy_value(arguments[i]);
+    victim->parameters[i] = strdup(parameters[i]);
+  }
+  victim->input_count = count;
+  victim->epoch = owner->definition_epoch;
+  victim->ctx = owner;
+  victim->last_used = ++shard->clock;
+  victim->val = copy_value(res.result_value);
+  pthread_mutex_unlock(&shard->lock);
+  return res;
+}
+
+// Evaluates untrusted code within `limits`. Exceeding a limit or using a
+// builtin that isn't allowed stops the evaluation with an error result.
+result eval_sandboxed(context *ctx, ast_node *node,
+                      const sandbox_limits *limits) {
+  sandbox sb;
+  sb.limits = limits;
+  sb.fuel_left = limits->fuel;
+  sb.deadline_us = monotonic_microseconds() + limits->timeout_us;
+  sb.memory_baseline = thread_heap_usage();
+  sb.steps_until_check = SANDBOX_CHECK_INTERVAL;
+
+  sandbox *outer = ctx->sandbox;
+  ctx->sandbox = &sb;
+  result res = eval_ast_node(ctx, NULL, node);
+  ctx->sandbox = outer;
+
+  // The result itself counts against the memory limit too.
+  if (!res.is_error && limits->memory_bytes &&
+      sandbox_memory_usage(&sb) > limits->memory_bytes) {
+    free_result(res);
+    return create_error_result("Evaluation exceeded its memory limit");
+  }
+  return res;
+}
+
+// Parses and evaluates a single untrusted expression within `limits`.
+result eval_sandboxed_source(context *ctx, const char *source,
+                             const sandbox_limits *limits) {
+  size_t pos = 0;
+  parse_result parsed = parse(source, &pos);
+  if (parsed.is_error) {
+    result res = create_error_result(parsed.error_message);
+    free_parse_result(parsed);
+    return res;
+  }
+
+  skip_whitespace(source, &pos);
+  if (source[pos] != '\0') {
+    free_parse_result(parsed);
+    return create_error_result("Expected a single expression");
+  }
+
+  result res = eval_sandboxed(ctx, parsed.node, limits);
+  free_parse_result(parsed);
+  return res;
+}
+
+void process_yalisp_shell_input(context *ctx, const char *input) {
+  size_t pos = 0;
+  while (1) {
+    skip_whitespace(input, &pos);
+    if (input[pos] == '\0')
+      return;
+
+    parse_result parse_result = parse_interned(input, &pos, ctx->interner);
+    if (parse_result.is_error) {
+      printf("Error: %s\n", parse_result.error_message);
+      free_parse_result(parse_result);
+      return;
+    }
+
+    result eval_result = eval_ast_node(ctx, NULL, parse_result.node);
+    if (eval_result.is_error) {
+      printf("Error: %s\n", eval_result.error_message);
+      free_parse_result(parse_result);
+      free_result(eval_result);
+      return;
+    }
+
+    print_value(eval_result.result_value);
+    printf("\n");
+
+    free_result(eval_result);
+    free_parse_result(parse_result);
+    reclaim_retired_values(ctx);
+    run_finalizers(&ctx->finalizers);
+  }
+}
+
+typedef void (*worker_function)(context *ctx, void *data);
+
+// Forks a worker process that runs `worker` in an overlay context on top of
+// `prelude`, which must be frozen. The worker shares the prelude's pages with
+// the parent copy-on-write; since nothing writes to a frozen context and the
+// worker exits without tearing anything down, those pages stay shared.
+// Returns the worker's pid, or -1 if it could not be forked.
+pid_t spawn_yalisp_worker(const context *prelude, worker_function worker,
+                          void *data) {
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+
+  context *ctx = create_overlay_context(prelude);
+  worker(ctx, data);
+  fflush(NULL);
+  _exit(0);
+}
+
+typedef struct file_job {
+  const char *path;
+  const char *profile_path; // NULL when profiles aren't kept
+} file_job;
+
+void load_file_worker(context *ctx, void *data) {
+  file_job *job = data;
+  result res = load_yalisp_file(ctx, job->path);
+  if (res.is_error) {
+    printf("Error: %s: %s\n", job->path, res.error_message);
+    fflush(NULL);
+    _exit(1);
+  }
+  free_result(res);
+
+  if (job->profile_path) {
+    res = write_function_profiles(ctx, job->profile_path, 1);
+    if (res.is_error)
+      printf("Error: %s: %s\n", job->profile_path, res.error_message);
+    free_result(res);
+  }
+}
+
+// Loads every file in its own worker process on top of a frozen, already
+// warmed up prelude. Workers append the profiles of the functions they define
+// to `profile_path`, if given, and once they're done the file is rewritten
+// with them merged into the prelude's. Returns the number of workers that
+// failed.
+int run_yalisp_workers(context *prelude, char **paths, size_t count,
+                       const char *profile_path) {
+  pid_t *pids = malloc(sizeof(pid_t) * count);
+  for (size_t i = 0; i < count; i++) {
+    file_job job = {paths[i], profile_path};
+    pids[i] = spawn_yalisp_worker(prelude, load_file_worker, &job);
+  }
+
+  int failures = 0;
+  for (size_t i = 0; i < count; i++) {
+    int status;
+    if (pids[i] < 0 || waitpid(pids[i], &status, 0) < 0 ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failures++;
+  }
+  free(pids);
+
+  if (profile_path) {
+    result res = load_function_profiles(prelude, profile_path);
+    if (!res.is_error) {
+      free_result(res);
+      res = write_function_profiles(prelude, profile_path, 0);
+    }
+    if (res.is_error)
+      printf("Error: %s: %s\n", profile_path, res.error_message);
+    free_result(res);
+  }
+  return failures;
 }
 
-void run_yalisp_shell() {
+void run_yalisp_shell(context *ctx) {
   char input[1024];
   printf("Welcome to Yet Another Lisp (YALisp)!\n");
   printf("Type in lisp expressions, and I'll execute them :3\n");
@@ -381,8 +6510,8 @@ void run_yalisp_shell() {
     if (!fgets(input, sizeof(input), stdin))
       break;
 
-    process_yalisp_shell_input(input);
+    process_yalisp_shell_input(ctx, input);
   }
 }
 
-#endif /* _YALISP_H_ */
\ No newline at end of file
+#endif /* _YALISP_H_ */